@@ -0,0 +1,35 @@
+#!/bin/bash
+# Reports the number of memory allocations per input record for a few typical queries.
+# Allocations made by an empty query (mostly parsing the input) are not counted.
+# Usage: alloc-count.sh [unq-binary] [records]
+UNQ=${1:-../../unq/bin/Release/unq}
+RECORDS=${2:-100000}
+TMP=$(mktemp -d)
+trap "rm -rf $TMP" EXIT
+
+cc -O2 -shared -fPIC -o $TMP/malloc_count.so malloc_count.c -ldl || exit 1
+
+python3 - $RECORDS > $TMP/records.json <<'PY'
+import json, random, sys
+random.seed(1)
+for i in range(int(sys.argv[1])):
+    print(json.dumps({"id": i, "user": "user%d" % (i % 100), "amount": random.randint(0, 1000),
+                      "price": random.random()*100, "tags": ["t%d" % (i % 7), "t%d" % (i % 3)],
+                      "sub": {"x": i % 50, "y": "s"}}))
+PY
+
+function count() {
+    LD_PRELOAD=$TMP/malloc_count.so $UNQ "$@" 2>&1 >/dev/null | sed -n 's/malloc calls: //p'
+}
+
+base=$(count -c '{}' $TMP/records.json)
+printf "%-45s %s\n" "query" "allocations/record"
+for q in \
+    '{"n":"$count","s":"$sum(amount)"}' \
+    '{"#if":"amount>100 and sub.x<40","n":"$count"}' \
+    '{"$(user)":{"n":"$count","a":"$avg(price)"}}' \
+    '{"missing":"$sum(nothere)","m":"$max(sub.nothere)"}' \
+    '{"t:tags[]":{"$(.)":"$count"}}'; do
+    n=$(count -c "$q" $TMP/records.json)
+    awk -v q="$q" -v n=$n -v b=$base -v r=$RECORDS 'BEGIN {printf "%-45s %.1f\n", q, (n-b)/r}'
+done
@@ -0,0 +1,24 @@
+// Counts calls to malloc (and operator new, which uses it) and prints the total at exit.
+// Build as a shared library and load with LD_PRELOAD.
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+static atomic_ulong malloc_calls;
+static void* (*real_malloc)(size_t) = NULL;
+
+void* malloc(size_t size)
+{
+    if (!real_malloc) {
+        real_malloc = dlsym(RTLD_NEXT, "malloc");
+    }
+    atomic_fetch_add_explicit(&malloc_calls, 1, memory_order_relaxed);
+    return real_malloc(size);
+}
+
+__attribute__((destructor)) static void report(void)
+{
+    fprintf(stderr, "malloc calls: %lu\n", (unsigned long)atomic_load(&malloc_calls));
+}
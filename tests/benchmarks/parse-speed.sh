@@ -0,0 +1,42 @@
+#!/bin/bash
+# Reports the JSON parsing throughput (MB/s) of one or more unq binaries, e.g. built with and without
+# -DUNQ_SIMD=SSE42, on the tutorial samples scaled up to a large input, read normally and with -mmap.
+# The query reads whole documents, so that every field is parsed.
+# Usage: parse-speed.sh [copies] [unq-binary...]
+COPIES=${1:-100000}
+shift
+BINARIES=${@:-../../unq/bin/Release/unq}
+SAMPLES=../../tutorial-samples/employees
+TMP=$(mktemp -d)
+trap "rm -rf $TMP" EXIT
+
+python3 - $COPIES $TMP $SAMPLES/*.json <<'PY'
+import json, sys
+docs = [json.load(open(f)) for f in sys.argv[3:]]
+with open(sys.argv[2] + "/ndjson.json", "w") as ndjson, open(sys.argv[2] + "/pretty.json", "w") as pretty:
+    for i in range(int(sys.argv[1])):
+        for d in docs:
+            print(json.dumps(d), file=ndjson)
+            print(json.dumps(d, indent=4), file=pretty)
+PY
+
+function speed() {
+    python3 - "$@" <<'PY'
+import os, subprocess, sys, time
+file, cmd = sys.argv[1], sys.argv[2:]
+best = None
+for i in range(3):
+    start = time.perf_counter()
+    subprocess.run(cmd + ["-c", '{"#if":". != 0","n":"$count"}', file], stdout=subprocess.DEVNULL, check=True)
+    t = time.perf_counter() - start
+    best = t if best is None else min(best, t)
+print("%.1f" % (os.path.getsize(file) / 1048576 / best))
+PY
+}
+
+printf "%-40s %-8s %12s %12s\n" "binary" "input" "MB/s" "MB/s (-mmap)"
+for unq in $BINARIES; do
+    for input in ndjson pretty; do
+        printf "%-40s %-8s %12s %12s\n" $unq $input $(speed $TMP/$input.json $unq) $(speed $TMP/$input.json $unq -mmap)
+    done
+done
@@ -14,6 +14,133 @@ function test_query() {
     diff -Naur expected/$basefile.errors results/$basefile.errors || true
 }
 
+# Run the query with multiple threads, and compare with the same expected results
+function test_parallel() {
+    basefile=$2${1##*/}
+    $UNQ -f $1 -j 3 ${@:3} >results/parallel_$basefile 2> results/parallel_${basefile}.errors
+    if [ -s expected/$basefile ]; then
+	$JSONCOMPARE expected/$basefile results/parallel_$basefile
+    fi
+    diff -Naur expected/$basefile.errors results/parallel_$basefile.errors || true
+}
+
+# Run the query on memory-mapped input files, and compare with the same expected results
+function test_mmap() {
+    basefile=$2${1##*/}
+    $UNQ -f $1 -mmap ${@:3} >results/mmap_$basefile 2> results/mmap_${basefile}.errors
+    if [ -s expected/$basefile ]; then
+	$JSONCOMPARE expected/$basefile results/mmap_$basefile
+    fi
+    diff -Naur expected/$basefile.errors results/mmap_$basefile.errors || true
+}
+
+# Run the query with the input files read and parsed in a pipeline, and compare with the same expected results
+function test_pipeline() {
+    basefile=$2${1##*/}
+    $UNQ -f $1 -pipeline 2 ${@:3} >results/pipeline_$basefile 2> results/pipeline_${basefile}.errors
+    if [ -s expected/$basefile ]; then
+	$JSONCOMPARE expected/$basefile results/pipeline_$basefile
+    fi
+    diff -Naur expected/$basefile.errors results/pipeline_$basefile.errors || true
+}
+
+# Run the query with the result printed in a single line, and compare with the same expected results
+function test_compact() {
+    basefile=$2${1##*/}
+    $UNQ -f $1 -compact ${@:3} >results/compact_$basefile 2> results/compact_${basefile}.errors
+    if [ -s expected/$basefile ]; then
+	$JSONCOMPARE expected/$basefile results/compact_$basefile
+    fi
+    diff -Naur expected/$basefile.errors results/compact_$basefile.errors || true
+}
+
+# Run the query on each input value separately with -per-doc. The output has a result per line (not a single
+# JSON value), so it is compared line by line.
+function test_per_doc() {
+    basefile=per_doc_$2${1##*/}
+    $UNQ -f $1 -per-doc ${@:3} >results/$basefile 2> results/${basefile}.errors
+    diff -Naur expected/$basefile results/$basefile || true
+    diff -Naur expected/$basefile.errors results/$basefile.errors || true
+}
+
+# Run a query with sorted arrays larger than the memory limit of -sort-memory, so that they are sorted in
+# temporary files, and compare with the result sorted in memory
+function test_sort_memory() {
+    seq 1 20000 | awk '{print "{\"k\":" ($1*7919)%20011 ",\"s\":\"s" $1%100 "\"}"}' >results/sort_memory.json
+    query='{"asc":["k@ascending"], "desc":["s@descending"], "rows":[{"s":"s@ascending(1)","k":"k@descending(2)"}]}'
+    $UNQ -c "$query" results/sort_memory.json >results/sort_memory_expected.json
+    $UNQ -c "$query" -sort-memory 1 results/sort_memory.json >results/sort_memory_results.json
+    $JSONCOMPARE results/sort_memory_expected.json results/sort_memory_results.json
+    $UNQ -c "$query" -sort-memory 1 -j 3 results/sort_memory.json >results/parallel_sort_memory_results.json
+    $JSONCOMPARE results/sort_memory_expected.json results/parallel_sort_memory_results.json
+}
+
+# Print the peak memory (resident set, in KB) of a command, which is polled while it runs
+function peak_memory() {
+    "$@" >/dev/null &
+    local pid=$! peak=0 kb
+    while kill -0 $pid 2>/dev/null; do
+        kb=$(awk '/VmHWM/ {print $2}' /proc/$pid/status 2>/dev/null)
+        if [ -n "$kb" ]; then
+            peak=$kb
+        fi
+        sleep 0.01
+    done
+    wait $pid
+    echo $peak
+}
+
+# Run a query with a limit on a sorted array over inputs of different sizes. The values of the elements that
+# are dropped must be released, so that the memory doesn't grow with the input.
+function test_limit_memory() {
+    for n in 50000 200000; do
+        seq 1 $n | awk '{printf "{\"id\":%d,\"amount\":%d,\"note\":\"note %060d\",\"tags\":[\"a%d\",\"b%d\"]}\n", $1, ($1*7919)%100003, $1, $1%7, $1}' >results/limit_memory_$n.json
+    done
+    query='[{"id":"id","note":"note","tags":"tags","amount":"amount@descending limit 10"}]'
+    small=$(peak_memory $UNQ -c "$query" results/limit_memory_50000.json)
+    large=$(peak_memory $UNQ -c "$query" results/limit_memory_200000.json)
+    if [ $large -gt $((small*5/4+1024)) ]; then
+        echo "Memory of a sorted array with a limit grows with the input: ${small}KB, ${large}KB"
+    fi
+}
+
+# Same for an array with unique sorting keys, where only the values of distinct elements must be kept
+function test_unique_memory() {
+    for n in 50000 200000; do
+        seq 1 $n | awk '{printf "{\"id\":%d,\"key\":\"%0100d\"}\n", $1, $1%2000}' >results/unique_memory_$n.json
+    done
+    query='["key@unique_ascending"]'
+    small=$(peak_memory $UNQ -c "$query" results/unique_memory_50000.json)
+    large=$(peak_memory $UNQ -c "$query" results/unique_memory_200000.json)
+    if [ $large -gt $((small*5/4+1024)) ]; then
+        echo "Memory of a sorted array with unique keys grows with the input: ${small}KB, ${large}KB"
+    fi
+}
+
+# Run a query with caches that are keyed on input values ($lookup, and in with a large array) on many files
+# with -pipeline, and compare with the result without it. The values of one file must not be mistaken for
+# those of another file.
+function test_pipeline_caches() {
+    mkdir results/pipeline_caches
+    for i in $(seq 10 69); do
+        list=$(seq -s, $((i*100)) $((i*100+19)))
+        refs=$(for j in $(seq 0 19); do id=$(((j+i)%20)); echo "{\"id\":$id,\"v\":$((i*1000+id))}"; done | paste -sd,)
+        echo "{\"x\":$((i*100+5)),\"list\":[$list],\"k\":3,\"refs\":[$refs]}" >results/pipeline_caches/$i.json
+    done
+    query='[{"#if":"x in list","x":"x","v":"$lookup(refs,\u0027id\u0027,k).v"}]'
+    $UNQ -c "$query" results/pipeline_caches/*.json >results/pipeline_caches_expected.json
+    $UNQ -c "$query" -pipeline 1 results/pipeline_caches/*.json >results/pipeline_caches_results.json
+    $JSONCOMPARE results/pipeline_caches_expected.json results/pipeline_caches_results.json
+    # Each document's lookup source must be indexed again, also when its memory is released after each document
+    query='{"x":"x","v":"$lookup(refs,\u0027id\u0027,k).v"}'
+    $UNQ -c "$query" -per-doc results/pipeline_caches/*.json >results/pipeline_caches_per_doc_expected.json
+    $UNQ -c "$query" -per-doc -pipeline 1 results/pipeline_caches/*.json >results/pipeline_caches_per_doc_results.json
+    diff results/pipeline_caches_per_doc_expected.json results/pipeline_caches_per_doc_results.json
+    query='{"#if":"x in list","x":"x"}'
+    $UNQ -c "$query" -per-doc results/pipeline_caches/*.json >results/pipeline_caches_in_expected.json
+    $UNQ -c "$query" -per-doc -pipeline 1 results/pipeline_caches/*.json >results/pipeline_caches_in_results.json
+    diff results/pipeline_caches_in_expected.json results/pipeline_caches_in_results.json
+}
 
 rm -rf results
 mkdir results
@@ -21,6 +148,22 @@ for f in ${EMPLOYEES}/queries/*.unq; do
     test_query $f employee_ $EMPLOYEES/employee*.json
 done
 
+for f in ${EMPLOYEES}/queries/*.unq; do
+    test_parallel $f employee_ $EMPLOYEES/employee*.json
+done
+
+for f in ${EMPLOYEES}/queries/*.unq; do
+    test_mmap $f employee_ $EMPLOYEES/employee*.json
+done
+
+for f in ${EMPLOYEES}/queries/*.unq; do
+    test_pipeline $f employee_ $EMPLOYEES/employee*.json
+done
+
+for f in ${EMPLOYEES}/queries/*.unq; do
+    test_compact $f employee_ $EMPLOYEES/employee*.json
+done
+
 for f in parsing/*.unq; do
     test_query $f parsing_ $EMPLOYEES/employee1.json
 done
@@ -28,7 +171,25 @@ done
 for f in extra/*.unq; do
     test_query $f extra_ ${f%.*}.json
 done
+# Duplicates of unique sorting keys are removed across threads as well
+test_parallel extra/test6.unq extra_ extra/test6.json extra/test6.json extra/test6.json
+
+for f in stream/*.unq; do
+    test_query $f stream_ -stream data.orders ${f%.*}.json
+done
 
 for f in stackoverflow/*.unq; do
     test_query $f stackoverflow_ ${f%.*}.json
 done
+
+test_query csv/orders.unq csv_ -csv csv/orders.csv
+test_query csv/orders-rows.unq csv_ -csv -stream . csv/orders.csv
+test_query csv/orders.unq csv_trailing_ -csv csv/trailing.csv
+test_per_doc stream/orders.unq stream_ -stream data.orders stream/orders.json
+test_per_doc stream/previous-items.unq stream_ -stream data.orders stream/previous-items.json
+test_query stream/orders.unq stream_dotted_ -stream 'data.`v1.orders`' stream/dotted-keys.json
+test_query stream/orders.unq stream_not_array_ -stream data.count stream/orders.json
+test_sort_memory
+test_limit_memory
+test_unique_memory
+test_pipeline_caches
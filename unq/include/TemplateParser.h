@@ -52,6 +52,7 @@ public:
     bool lookAhead(const std::string& s);
     bool ifNext(const std::string& s);
     void throwError(const std::string& msg);
+    void checkRegex(const std::string& pattern);
 
     TQKeyP key();
     TemplateQueryP context_mod(bool frame_flag = true, ContextModMode parse_mode = ContextModMode::None);
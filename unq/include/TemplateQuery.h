@@ -10,9 +10,24 @@
 #include <vector>
 #include <iostream>
 #include <regex>
+#include <set>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
 
 namespace xcite {
 
+// Without a database backend, data is only read from local JSON documents, and the code for reading 
+// from the database is never used.
+#ifdef UNQ_LOCAL_JSON_ONLY
+constexpr bool local_json_only = true;
+#else
+constexpr bool local_json_only = false;
+#endif
+
 typedef std::shared_ptr<rapidjson::Document> json_documentP;
 typedef std::shared_ptr<pugi::xml_document> xml_documentP;
 typedef std::shared_ptr<JSONMetaReader> JSONMetaReaderP;
@@ -29,13 +44,10 @@ class TQData;
 typedef std::shared_ptr<TQData> TQDataP;
 class TemplateQuery;
 typedef std::shared_ptr<TemplateQuery> TemplateQueryP;
-
-class DontDeleteJSONValue
-{
-public:
-    void operator() (JSONValue*) const {}
-};
-
+class TQAggregateData;
+typedef std::shared_ptr<TQAggregateData> TQAggregateDataP;
+class TExprAggregate;
+class TExprCall;
 
 class QueryError
 {
@@ -54,6 +66,58 @@ enum class OrderType {
     None, Ascend, Descend, UAscend, UDescend
 };
 
+// A single step in a path within a JSON document
+struct PathStep
+{
+    enum class Type {Member, Index, Root, Up};
+    PathStep(Type t, const std::string& n = {}, int i = 0): type(t), name(n), index(i) {}
+
+    Type type;
+    // Unescaped member name
+    std::string name;
+    int index;
+};
+
+typedef std::vector<PathStep> PathSteps;
+
+PathSteps compilePath(const std::string& path);
+
+// Compile a regular expression that is going to be matched many times
+std::regex compileRegex(const std::string& pattern);
+
+// A path, parsed once into steps that can be followed directly in a local JSON document.
+// The original path string is kept for everything else (e.g. reading paths from the database).
+class FieldPath
+{
+public:
+    FieldPath() {}
+    FieldPath(const std::string& p);
+
+    const std::string& str() const {return path;}
+    const PathSteps& steps() const {return path_steps;}
+    // Unique number of this path, used as its slot in TQContext's cache of resolved paths
+    size_t id() const {return path_id;}
+private:
+    std::string path;
+    PathSteps path_steps;
+    size_t path_id = 0;
+};
+
+// The top-level members of the input documents that a query may read. Members that aren't used
+// can be skipped when parsing the input.
+class FieldUsage
+{
+public:
+    void add(const std::string& field) {fields.insert(field);}
+    // Any member may be used (e.g. by "**", regex keys or computed paths)
+    void addAll() {all = true;}
+    bool usesAll() const {return all;}
+    bool contains(std::string_view field) const {return all || fields.find(field)!=fields.end();}
+private:
+    bool all = false;
+    std::set<std::string, std::less<> > fields;
+};
+
 struct Function {
     Function() {}
     Function(const TemplateQueryP& b, std::vector<string>& v)
@@ -94,10 +158,7 @@ public:
         return indexes.back();
     }
     const string& path() {
-        if (paths.empty()) {
-            return empty_string;
-        }
-        return paths.back();
+        return pathAt(paths.size()-1);
     }
 
     const string& filename() {
@@ -108,6 +169,9 @@ public:
     }
 
     JSONValueP localJSON() {
+        if (local_json_only && localJSONs.empty()) {
+            return nullJSON();
+        }
         return localJSONs.back();
     }
 
@@ -144,6 +208,9 @@ public:
     void pushPath(const string& path);
     void adjustPath(const string& path);
     void addToPath(const string& added);
+    void addToPath(const FieldPath& added);
+    // Add the element at the given index of the current (array) context
+    void addIndexToPath(int index);
     void pushIdentifier(const string& identifier, const string& index = {});
     void pushDate(const string& date);
     void pushBranch(const string& branch);
@@ -173,6 +240,10 @@ public:
         return findLocalPath(path, localJSON(), allow_projection);
     }
     JSONValueP findLocalPath(const string& path, JSONValueP val, bool allow_projection);
+    JSONValueP findLocalPath(const PathSteps& steps, bool allow_projection = true) {
+        return findLocalPath(steps, localJSON(), allow_projection);
+    }
+    JSONValueP findLocalPath(const PathSteps& steps, JSONValueP val, bool allow_projection);
     bool isObject(const string& key);
     bool isArray(const string& key);
     bool isString(const string& key);
@@ -181,6 +252,15 @@ public:
     bool isBool(const string& key);
     bool exists(const string& key);
     JSONValueP getJSON(const string& key);
+    // Same as above, using a precompiled path
+    bool isObject(const FieldPath& key);
+    bool isString(const FieldPath& key);
+    bool isDouble(const FieldPath& key);
+    bool isInt(const FieldPath& key);
+    bool isBool(const FieldPath& key);
+    bool exists(const FieldPath& key);
+    JSONValueP getJSON(const FieldPath& key);
+    int getArraySize(const FieldPath& key);
     string getMetaKey(const string& key);
     string getString(const string& key);
     int64_t getInt(const string& key);
@@ -188,12 +268,38 @@ public:
     bool getBool(const string& key);
     int getArraySize(const string& key);
     ObjectFieldSet getMembers(const string& key);
+    // Compiled regular expression for a pattern that is known only while processing data
+    const std::regex& getRegex(const string& pattern);
+    // Position of the first element of the array source whose value at key_path is key (as a string), or -1.
+    // The index is built once for each owner (the $lookup expression) and source value, and kept until the 
+    // owner is used with another source.
+    int lookup(const void* owner, const JSONValueP& source, const PathSteps& key_path, const string& key);
+    // Whether value is an element of the array arr. A large array that is tested again for the same owner
+    // (the condition), such as a variable, is put in a hash set, which is kept until the owner gets another array.
+    bool inArray(const void* owner, const JSONValueP& arr, const JSONValue& value);
+    // Allocator for values built by TQData::getJSON(). These are temporary while processing data, 
+    // and part of the result when building it.
+    rapidjson::MemoryPoolAllocator<>& allocator() {
+        return in_get_JSON?doc->GetAllocator():scratch;
+    }
+    // Allocator for the values that data objects keep (see data_alloc)
+    rapidjson::MemoryPoolAllocator<>& dataAllocator() {
+        return data_alloc?*data_alloc:doc->GetAllocator();
+    }
 
 public:
     XMLReaderP xml_reader;
     json_documentP doc;
+    // Temporary values that are needed only while processing the current document. Cleared by reset().
+    rapidjson::MemoryPoolAllocator<> scratch;
     bool in_get_JSON = false;
     bool opt_show_null = false;
+    // Memory for the elements of an ordered array, in bytes, before they are sorted and written to a temporary 
+    // file (0 for no limit)
+    size_t opt_sort_memory = 0;
+    // If set, data objects keep their values here instead of in doc. Ordered arrays that may be written to 
+    // temporary files set it while processing their elements, so that the memory is released when they are written.
+    rapidjson::MemoryPoolAllocator<>* data_alloc = nullptr;
     bool in_key = false;
 
 private:
@@ -201,7 +307,23 @@ private:
     typedef std::vector<int> IntQueue;
     typedef std::vector<JSONValueP> JSONQueue;
     const string empty_string = {};
-    StringQueue paths;
+
+    // An entry in the path stack. The full textual path is built only when it's needed (for $path,
+    // $key, $index, or for reading from the database), from the path of the entry it was added to.
+    struct PathEntry {
+        enum class Type {Full, Relative, Index};
+        PathEntry(Type t, int b, const string& s, int i = 0)
+            : type(t), base(b), step(s), index(i), built(t==Type::Full) {}
+
+        Type type;
+        int base;
+        // The full path (when built), or the relative path that was added
+        string step;
+        int index;
+        bool built;
+    };
+    const string& pathAt(int i);
+    std::vector<PathEntry> paths;
     StringQueue indexes;
     StringQueue identifiers;
     StringQueue filenames;
@@ -224,14 +346,62 @@ private:
     JSONMetaReaderP tr;
 
     bool in_local = false;
+    // Whether data is read from the local JSON or from the database
+    bool readLocal() const {return local_json_only || in_local;}
+
+    // Precompiled paths already resolved in the current local JSON. An entry is valid only as
+    // long as local_generation is unchanged (it changes whenever localJSONs or localDocs change).
+    struct ResolvedPath {
+        uint64_t generation[2] = {0, 0};
+        JSONValueP value[2];
+    };
+    JSONValueP resolvePath(const FieldPath& key, bool allow_projection = true);
+    std::vector<ResolvedPath> resolved_paths;
+    uint64_t local_generation = 1;
+
+    std::unordered_map<string, std::regex> regexes;
+
+    // Whether a value is the source of a cached index: the same address and the same owner. The cached source 
+    // is kept, so its owner can't be released. A value with the same address but a new owner is another value 
+    // in the same memory, which happens when the memory isn't owned by the value (e.g. it's in a file buffer, or 
+    // an allocator that is cleared for each document).
+    static bool sameSource(const JSONValueP& cached, const JSONValueP& value) {
+        return cached==value && !cached.owner_before(value) && !value.owner_before(cached);
+    }
+
+    struct LookupIndex {
+        // The indexed value is kept, so that its owner is not released (see sameSource())
+        JSONValueP source;
+        std::unordered_map<string, int> positions;
+    };
+    std::unordered_map<const void*, LookupIndex> lookup_indexes;
+
+    struct MemberSet {
+        // The array is kept, so that its owner is not released (see sameSource())
+        JSONValueP source;
+        bool hashed = false;
+        std::unordered_set<const JSONValue*, JSONHash, JSONEqual> values;
+    };
+    std::unordered_map<const void*, MemberSet> member_sets;
 };
 
+// A value that data is ordered by in a sorted array, with the sorting specifier's number and type
+struct SortKey {
+    int num;
+    OrderType type;
+    const JSONValue* value;
+};
+typedef std::vector<SortKey> SortKeys;
+
 class TQData
 {
 public:
     virtual ~TQData() {}
     virtual bool processData(TQContext& ctx) = 0;
     virtual JSONValue getJSON(TQContext& ctx) = 0;
+    // Write the value of getJSON() to out, preceded by key (when not null), without building it first.
+    // Returns false, and writes nothing, if the value is null.
+    virtual bool writeJSON(TQContext& ctx, JSONOutput& out, const string* key);
     virtual TemplateQuery* getTQ() = 0;
 
     virtual bool isXML(TQContext* ctx = NULL) {return false;}
@@ -248,10 +418,35 @@ public:
     virtual bool isAggregate(TQContext* ctx) const {return true;}
     virtual bool compare(const TQDataP& other) const {return false;}
     virtual bool equal(const TQDataP& other) const {return false;}
+    // Add the values that compare() and equal() use
+    virtual void getSortKeys(SortKeys& keys) const {}
+
+    // Merge data collected by another data object made from the same TemplateQuery.
+    // Used for combining the results of multiple threads, where each processed a subset of the input.
+    virtual void merge(const TQDataP& other, TQContext& ctx) {mergeState(other.get(), ctx);}
+    // Copy the values that the data keeps (see TQContext::dataAllocator()) to alloc, so that the allocator 
+    // they were in can be released
+    virtual void relocate(rapidjson::MemoryPoolAllocator<>& alloc);
+
+    // State of aggregate functions and function calls, that were evaluated in the context of this data object
+    // (a data object has very few aggregates, so a vector is faster to search than a map)
+    std::vector<std::pair<TExprAggregate*, TQAggregateDataP> > aggregates;
+    std::map<TExprCall*, TQDataP> calls;
+
+protected:
+    void mergeState(const TQData* other, TQContext& ctx);
 };
 
 bool compare_data(const TQDataP& a, const TQDataP& b);
 bool equal_data(const TQDataP& a, const TQDataP& b);
+// Same as compare_data() and equal_data(), for data that is represented by its sort keys
+bool compare_sort_keys(const SortKeys& a, const SortKeys& b);
+bool equal_sort_keys(const SortKeys& a, const SortKeys& b);
+// The order of two values in a sorted array (in ascending order)
+bool less_value(const JSONValue& x, const JSONValue& y);
+
+// The stricter of two limits on the number of elements, where 0 is no limit
+inline size_t minLimit(size_t a, size_t b) {return (a==0||(b!=0&&b<a))?b:a;}
 
 class TemplateQuery
 {
@@ -263,8 +458,13 @@ public:
     virtual OrderType getOrderType() const {return OrderType::None;}
     virtual int getOrderNumber() const {return 0;}
     virtual bool isOrdered() const {return false;}
+    // The number of elements that are kept in an ordered array (0 for all of them)
+    virtual size_t getLimit() const {return 0;}
     virtual bool isPlaceholder() const {return false;}
     virtual TemplateQueryP replace(const TemplateQueryP& val) {return TemplateQueryP(NULL);}
+    // Add the top-level fields that may be read when processing data, where at_root means 
+    // that the current context may be the root of the document.
+    virtual void collectFields(FieldUsage& used, bool at_root) const {used.addAll();}
 };
 
 class TQPlaceholder: public TemplateQuery
@@ -272,6 +472,7 @@ class TQPlaceholder: public TemplateQuery
     virtual TQDataP makeData() {return {}; }
     virtual bool isPlaceholder() const {return true;}
     virtual TemplateQueryP replace(const TemplateQueryP& val) {return val;}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
 };
 
 
@@ -293,6 +494,7 @@ public:
     virtual Strings getKeys(TQContext& ctx) = 0;
     virtual KeyType getKeyType() const {return KeyType::Values;}
     virtual string getName() const {return {};}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
 
     virtual bool isSorted() const {return true;}
 };
@@ -306,6 +508,7 @@ public:
     virtual Strings getKeys(TQContext& ctx);
     virtual string getName() const {return key;}
     virtual bool isSorted() const {return false;}
+    const std::string& getKey() const {return key;}
 private:
     std::string key;
 };
@@ -315,6 +518,7 @@ class TQParamKey: public TQKey
 public:
     TQParamKey(const TExpressionP& e): expr(e) {}
     virtual Strings getKeys(TQContext& ctx);
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
     virtual bool isSorted() const;
 private:
     TExpressionP expr;
@@ -323,9 +527,14 @@ private:
 class TQRegexKey: public TQKey
 {
 public:
-    TQRegexKey(const string& s): r(s), re(s) {}
+    TQRegexKey(const string& s): r(s), re(compileRegex(s)) {}
     virtual Strings getKeys(TQContext& ctx);
     virtual bool isSorted() const {return false;}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {
+        if (at_root) {
+            used.addAll();
+        }
+    }
 private:
     string r;
     std::regex re;
@@ -382,6 +591,7 @@ public:
     virtual OrderType getOrderType() const {return val->getOrderType();}
     virtual int getOrderNumber() const {return val->getOrderNumber();}
     virtual bool isOrdered() const {return val->isOrdered();}
+    virtual size_t getLimit() const {return val->getLimit();}
     virtual bool isAggregate(TQContext* ctx) const {return val && val->isAggregate(ctx);}
 
     TemplateQueryP val;
@@ -403,7 +613,10 @@ public:
     virtual bool isEmpty() {return innerData->isEmpty();}
     virtual bool compare(const TQDataP& other) const;
     virtual bool equal(const TQDataP& other) const;
+    virtual void getSortKeys(SortKeys& keys) const {if (innerData) innerData->getSortKeys(keys);}
     virtual bool isInnerValue() {return true;}
+    virtual void merge(const TQDataP& other, TQContext& ctx);
+    virtual void relocate(rapidjson::MemoryPoolAllocator<>& alloc);
 
     TQDataP innerData;
 };
@@ -412,14 +625,26 @@ class TQContextMod: public TQInnerValue
 {
 public:
     TQContextMod(const TemplateQueryP& v, const string& c, ContextMode m, ArrowOp op, bool fr = false)
-        : TQInnerValue(v), context(c), mode(m), arrow(op), new_frame(fr) {}
+        : TQInnerValue(v), context(c), mode(m), arrow(op), new_frame(fr) 
+    {
+        if (mode==ContextMode::None || mode==ContextMode::Array) {
+            context_path = FieldPath(context);
+        } else if (mode==ContextMode::Regex) {
+            context_regex = compileRegex(context);
+        }
+    }
     TQContextMod(const TemplateQueryP& v, const TExpressionP& e, ContextMode m, ArrowOp op, bool fr = false)
         : TQInnerValue(v), expr(e), mode(m), arrow(op), new_frame(fr) {}
 
     virtual TQDataP makeData();
     virtual TemplateQueryP replace(const TemplateQueryP& val);
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 
     std::string context;
+    // The context as a precompiled path (only for path and array modes)
+    FieldPath context_path;
+    // The context as a compiled regular expression (only for regex mode)
+    std::regex context_regex;
     TExpressionP expr;
     ContextMode mode;
     ArrowOp arrow;
@@ -432,6 +657,7 @@ public:
     TQContextModData(TQContextMod* mod): q(mod) {}
     virtual bool processData(TQContext& ctx);
     virtual JSONValue getJSON(TQContext& ctx);
+    virtual bool writeJSON(TQContext& ctx, JSONOutput& out, const string* key);
     virtual TemplateQuery* getTQ() {return q;}
 
 
@@ -470,6 +696,7 @@ public:
 
     virtual TQDataP makeData();
     virtual TemplateQueryP replace(const TemplateQueryP& val);
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 
     std::vector<TemplateQueryP> vals;
 };
@@ -480,9 +707,12 @@ public:
     TQContextModOrData(TQContextModOr* mod): q(mod) {}
     virtual bool processData(TQContext& ctx);
     virtual JSONValue getJSON(TQContext& ctx);
+    virtual bool writeJSON(TQContext& ctx, JSONOutput& out, const string* key);
     virtual TemplateQuery* getTQ() {return q;}
 
     virtual bool isAggregate(TQContext* ctx) const;
+    virtual void merge(const TQDataP& other, TQContext& ctx);
+    virtual void relocate(rapidjson::MemoryPoolAllocator<>& alloc);
 
 private:
     TQContextModOr* q;
@@ -506,12 +736,21 @@ public:
 
     virtual TQDataP makeData();
     virtual TemplateQueryP replace(const TemplateQueryP& val);
+    virtual void collectFields(FieldUsage& used, bool at_root) const {val->collectFields(used, at_root);}
+
+    // Merge the shared data objects of 'src' into the ones of 'dst' (both are TQContextModOrData objects)
+    static void mergeShared(TQData* dst, TQData* src, TQContext& ctx);
+    // Release the shared data objects of all data trees. Used when data trees are discarded while processing
+    // the input (and only a single thread processes data), so that a new tree won't find the data of an old one.
+    static void releaseShared();
 protected:
     friend class TQSharedData;
     // Each TQShared object gets an id that remain constant even when duplicating with 'replace'.
     int id;
     // Vector of ids. Each entry is a map from data object pointers (set in TQContextModOrData::processData)
     static std::vector<std::map<TQData*,TQDataP> > data_map;
+    // Guards data_map when multiple threads process data
+    static std::mutex data_map_mutex;
 };
 
 class TQSharedData: public TQInnerValueData
@@ -520,9 +759,13 @@ public:
     TQSharedData(TQShared* shared): q(shared) {}
     virtual bool processData(TQContext& ctx);
     virtual JSONValue getJSON(TQContext& ctx);
+    virtual bool writeJSON(TQContext& ctx, JSONOutput& out, const string* key);
     virtual TemplateQuery* getTQ() {return q;}
+    virtual void merge(const TQDataP& other, TQContext& ctx);
 
     TQShared* q;
+    // The data object used as a key in data_map
+    TQData* owner = nullptr;
 };
 
 class TQArray: public TemplateQuery
@@ -531,10 +774,16 @@ public:
     TQArray() {}
     void add(const TemplateQueryP& val) {
         vals.push_back(val);
+        ordered = ordered || val->isOrdered();
+        limit = minLimit(limit, val->getLimit());
     }
     virtual TQDataP makeData();
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 
     std::vector<TemplateQueryP> vals;
+    bool ordered = false;
+    // The smallest limit of the ordered elements (0 for no limit)
+    size_t limit = 0;
 };
 
 typedef std::shared_ptr<TQArray> TQArrayP;
@@ -545,12 +794,60 @@ public:
     TQArrayData(TQArray* array): q(array) {}
     virtual bool processData(TQContext& ctx);
     virtual JSONValue getJSON(TQContext& ctx);
+    virtual bool writeJSON(TQContext& ctx, JSONOutput& out, const string* key);
     virtual TemplateQuery* getTQ() {return q;}
     virtual bool isEmpty() {return array.empty();}
+    virtual void merge(const TQDataP& other, TQContext& ctx);
+    virtual void relocate(rapidjson::MemoryPoolAllocator<>& alloc);
 
 private:
+    // Add an element, unless its sort keys are all unique and equal to those of an element in the array.
+    // Returns whether it was added.
+    bool addElement(const TQDataP& d);
+    // Sort the elements and remove duplicates, if the array is ordered, and drop the ones beyond the limit
+    void sortElements();
+    // Sort the elements and drop the ones beyond the limit, and copy the values of the rest to a new allocator
+    // (limit_alloc), so that the values of the dropped elements are released
+    void truncate();
+    // Sort the elements and remove duplicates by their sort keys encoded as strings of bytes. Returns false,
+    // without changing the array, if the elements can't be sorted that way (see sortElements()).
+    bool sortByKeys();
+    // Write the sorted elements to a temporary file, and release them
+    void spill(TQContext& ctx);
+    // Merge the elements in the temporary files in sorted order, and call f with the value of each of them
+    void mergeSpilled(TQContext& ctx, const std::function<void(const JSONValue&)>& f);
+    // Merge the records of the temporary files in sorted order, removing duplicates, and call f with each of them
+    void mergeRuns(const std::function<void(const JSONValue&)>& f);
+    // Merge all the temporary files into one, so that the number of open files stays small
+    void compactRuns();
+
     TQArray* q;
     std::vector<TQDataP> array;
+    // With a memory limit for sorting (opt_sort_memory), the values of the elements are kept here, and
+    // the elements that were written to temporary files (sorted runs of elements)
+    std::shared_ptr<rapidjson::MemoryPoolAllocator<> > run_alloc;
+    std::vector<std::shared_ptr<FILE> > runs;
+    // With a limit, the values of the elements are kept here, once the array has been cut down to the limit
+    std::unique_ptr<rapidjson::MemoryPoolAllocator<> > limit_alloc;
+
+    // The elements with unique sort keys (e.g. "x@unique_ascending"), with the hash of their keys, so that
+    // only the first of equal elements is kept, instead of keeping all of them until the array is sorted
+    struct DistinctElement {
+        size_t hash;
+        TQDataP data;
+    };
+    struct DistinctHash {
+        size_t operator()(const DistinctElement& e) const {return e.hash;}
+    };
+    struct DistinctEqual {
+        bool operator()(const DistinctElement& a, const DistinctElement& b) const {
+            return a.data->getTQ()==b.data->getTQ() && a.data->equal(b.data) && b.data->equal(a.data);
+        }
+    };
+    std::unique_ptr<std::unordered_set<DistinctElement, DistinctHash, DistinctEqual> > distinct;
+    // Once there are distinct elements, the values of a new element are kept here until it's known not to be 
+    // a duplicate, and then copied to the allocator of the array. It's cleared after each element.
+    std::unique_ptr<rapidjson::MemoryPoolAllocator<> > candidate_alloc;
 };
 
 class TQValueWithCond: public TQInnerValue
@@ -561,6 +858,7 @@ public:
     virtual TQDataP makeData();
     virtual TemplateQueryP replace(const TemplateQueryP& v);
     virtual bool isAggregate(TQContext* ctx) const;
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 
     TQConditionP cond;
 };
@@ -571,6 +869,7 @@ public:
     TQValueWithCondData(TQValueWithCond* tq): q(tq) {}
     virtual bool processData(TQContext& ctx);
     virtual JSONValue getJSON(TQContext& ctx);
+    virtual bool writeJSON(TQContext& ctx, JSONOutput& out, const string* key);
     virtual TemplateQuery* getTQ() {return q;}
 
     virtual bool isAggregate(TQContext* ctx) const;
@@ -594,9 +893,12 @@ public:
         : cond(c), this_p((TQData*)this, DoNothingDeleter()) {}
     virtual TQDataP makeData();
     virtual bool isAggregate(TQContext* ctx) const;
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
     virtual bool processData(TQContext& ctx);
     virtual JSONValue getJSON(TQContext& ctx) {return {};}
     virtual TemplateQuery* getTQ() {return this;}
+    // The data object is shared, so there is nothing to merge
+    virtual void merge(const TQDataP& other, TQContext& ctx) {}
 
     TQConditionP cond;
     TQDataP this_p;
@@ -608,10 +910,15 @@ public:
     virtual TQDataP makeData();
     void add(const TQKeyP& key, const TemplateQueryP& value, const TemplateQueryP& cond = {});
     virtual bool isOrdered() const {return ordered;}
+    virtual size_t getLimit() const {return limit;}
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 
     friend class TQObjectData;
 private:
     bool ordered = false;
+    size_t limit = 0;
+    // All the fields have a simple key, and their value is an aggregate function
+    bool aggregates_only = true;
     std::vector<TQDataP> conditions_data;
     std::vector<std::string> local_vars;
  
@@ -619,27 +926,60 @@ private:
  };
 
 
+// Fields of an object data, kept in insertion order, with an open-addressing hash index for looking up keys.
+// Each key is stored once, together with its hash.
+class FieldTable
+{
+public:
+    typedef std::pair<std::string, TQDataP> Field;
+
+    TQDataP* find(const std::string& key);
+    // Add a field, or replace the data of an existing one
+    void set(const std::string& key, const TQDataP& data);
+    // Sort the fields by key. Done only when producing the result, for sorted keys.
+    void sort();
+    bool empty() const {return fields.empty();}
+    std::vector<Field>::iterator begin() {return fields.begin();}
+    std::vector<Field>::iterator end() {return fields.end();}
+private:
+    // The slot of the key, or the empty slot where it should be added
+    size_t findSlot(const std::string& key, size_t hash) const;
+    void rebuildIndex(size_t capacity);
+
+    std::vector<Field> fields;
+    std::vector<size_t> hashes;
+    // Position in fields for each slot of the index, or -1 for an empty slot. The size is a power of 2.
+    std::vector<int> slots;
+    bool is_sorted = true;
+};
+
 class TQObjectData: public TQData
 {
 public:
     TQObjectData(TQObject* obj): q(obj) {}
     virtual bool processData(TQContext& ctx);
     virtual JSONValue getJSON(TQContext& ctx);
+    virtual bool writeJSON(TQContext& ctx, JSONOutput& out, const string* key);
     virtual TemplateQuery* getTQ() {return q;}
 
     virtual bool isOrdered() const {return q->isOrdered();}
     virtual bool compare(const TQDataP& other) const;
     virtual bool equal(const TQDataP& other) const;
+    virtual void getSortKeys(SortKeys& keys) const;
     virtual bool isEmpty() {return sorted_fields.empty()&&unsorted_fields.empty();}
+    virtual void merge(const TQDataP& other, TQContext& ctx);
+    virtual void relocate(rapidjson::MemoryPoolAllocator<>& alloc);
 
 private:
     TQDataP getFieldData(const string& key, TemplateQueryP& tq, bool sorted);
     void storeData(const string& key, TQDataP& data, bool sorted);
+    bool processAggregates(TQContext& ctx);
 
     TQObject* q;
-    std::map<std::string, int> unsorted_fields_map;
-    std::map<std::string, TQDataP> sorted_fields;
-    std::vector<std::pair<std::string, TQDataP> > unsorted_fields;
+    FieldTable sorted_fields;
+    FieldTable unsorted_fields;
+    // Data of the fields of an aggregates-only object, in the order of q->fields (and whether they were stored)
+    std::vector<std::pair<TQDataP, bool> > aggregate_fields;
     TQDataP returned;
     std::map<int, TQDataP> ordering;
 };
@@ -662,7 +1002,7 @@ public:
     JSONValueP asJSON(TQContext& ctx);
 
     virtual JSONValueP getJSON(TQContext& ctx)
-        {return JSONValueP(new JSONValue);}
+        {return nullJSON();}
     virtual string getString(TQContext& ctx)
         {return {};}
     virtual int64_t getInt(TQContext& ctx)
@@ -674,26 +1014,36 @@ public:
     virtual pugi::xml_node getXML(TQContext& ctx, pugi::xml_document& doc)
         {return {};}
     virtual string getFieldPath(TQContext& ctx) {return getString(ctx);}
+    // For field expressions with a path known at parse time, returns the precompiled path (otherwise NULL)
+    virtual const FieldPath* getConstPath() const {return NULL;}
+    // Same as TemplateQuery::collectFields()
+    virtual void collectFields(FieldUsage& used, bool at_root) const {used.addAll();}
 };
 
 class TQValue: public TemplateQuery
 {
 public:
-    TQValue(const TExpressionP& e, OrderType ot=OrderType::None, int on = 0)
-        : exp(e), ord_type(ot), ord_num(on) {}
+    TQValue(const TExpressionP& e, OrderType ot=OrderType::None, int on = 0, size_t ol = 0);
     virtual TQDataP makeData();
 
     virtual OrderType getOrderType() const {return ord_type;}
     virtual int getOrderNumber() const {return ord_num;}
     virtual bool isOrdered() const {return ord_type!=OrderType::None;}
+    virtual size_t getLimit() const {return ord_limit;}
     virtual bool isAggregate(TQContext* ctx) const {return exp->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {exp->collectFields(used, at_root);}
+    // The value is a single aggregate function (so it's always a number)
+    bool isAggregateFunction() const {return aggregate_func;}
+    const TExpressionP& expression() const {return exp;}
 
     friend class TQValueData;
      
 private:
     TExpressionP exp;
+    bool aggregate_func = false;
     OrderType ord_type;
     int ord_num;
+    size_t ord_limit;
 };
 
 class TQValueData: public TQData
@@ -702,6 +1052,7 @@ public:
     TQValueData(TQValue* tqv): q(tqv) {}
     virtual bool processData(TQContext& ctx);
     virtual JSONValue getJSON(TQContext& ctx);
+    virtual bool writeJSON(TQContext& ctx, JSONOutput& out, const string* key);
     virtual TemplateQuery* getTQ() {return q;}
     virtual bool isXML(TQContext* ctx) {return q->exp->isXML(ctx);}
     virtual bool isString(TQContext* ctx) {return q->exp->isString(ctx);}
@@ -715,6 +1066,9 @@ public:
     virtual bool isOrdered() const {return q->isOrdered();}
     virtual bool compare(const TQDataP& other) const;
     virtual bool equal(const TQDataP& other) const;
+    virtual void getSortKeys(SortKeys& keys) const;
+    virtual void merge(const TQDataP& other, TQContext& ctx);
+    virtual void relocate(rapidjson::MemoryPoolAllocator<>& alloc);
 
 private:
     TQValue* q;
@@ -729,6 +1083,8 @@ class TQCondition
 public:
     virtual bool test(TQContext& ctx) = 0;
     virtual bool isAggregate(TQContext* ctx) {return false;}
+    // Same as TemplateQuery::collectFields()
+    virtual void collectFields(FieldUsage& used, bool at_root) const {used.addAll();}
 };
 
 enum class Operator {
@@ -773,6 +1129,7 @@ public:
         : cond1(c1), cond2(c2), op(o) {}
     virtual bool test(TQContext& ctx);
     virtual bool isAggregate(TQContext* ctx) {return cond1->isAggregate(ctx)||cond2 && cond2->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 private:
     TQConditionP cond1;
     TQConditionP cond2;
@@ -782,15 +1139,21 @@ private:
 class TQStringTest: public TQCondition
 {
 public:
-    TQStringTest(const TExpressionP& x1, const TExpressionP& y1, Operator o)
-        : x(x1), y(y1), op(o) {}
+    TQStringTest(const TExpressionP& x1, const TExpressionP& y1, Operator o);
     virtual bool test(TQContext& ctx);
     virtual bool isAggregate(TQContext* ctx) {return x->isAggregate(ctx)||y->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {
+        x->collectFields(used, at_root);
+        y->collectFields(used, at_root);
+    }
     
 private:
     TExpressionP x;
     TExpressionP y;
     Operator op;
+    // For matching a literal pattern
+    bool const_regex = false;
+    std::regex re;
 };
 
 class TQCompareTest: public TQCondition
@@ -801,6 +1164,10 @@ public:
     virtual bool test(TQContext& ctx);
     template<typename T> bool test(T v1, T v2);
     virtual bool isAggregate(TQContext* ctx) {return x->isAggregate(ctx)||y->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {
+        x->collectFields(used, at_root);
+        y->collectFields(used, at_root);
+    }
     
 private:
     TExpressionP x;
@@ -835,9 +1202,11 @@ public:
         : x(x1), y(y1), op(o) {}
     virtual bool test(TQContext& ctx);
     virtual bool isAggregate(TQContext* ctx) {return x->isAggregate(ctx)||y->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {
+        x->collectFields(used, at_root);
+        y->collectFields(used, at_root);
+    }
 
-    bool in_operator(const JSONValueP& v1, const JSONValueP& v2);
-    
 private:
     TExpressionP x;
     TExpressionP y;
@@ -850,6 +1219,7 @@ public:
     TQExistsTest(const TExpressionP& x1)
         : x(x1) {}
     virtual bool test(TQContext& ctx);
+    virtual void collectFields(FieldUsage& used, bool at_root) const {x->collectFields(used, at_root);}
     
 private:
     TExpressionP x;
@@ -861,6 +1231,7 @@ public:
     TQTypeTest(const TExpressionP& x1, Operator o)
         : x(x1), op(o) {}
     virtual bool test(TQContext& ctx);
+    virtual void collectFields(FieldUsage& used, bool at_root) const {x->collectFields(used, at_root);}
     
 private:
     TExpressionP x;
@@ -871,7 +1242,7 @@ private:
 class TExprField: public TExpression
 {
 public:
-    TExprField(const std::string& f): field(f) {}
+    TExprField(const std::string& f): field(f), path(f=="."?"":f) {}
     TExprField(const TExpressionP& e): expr(e) {}
     std::string getFieldName(TQContext* ctx);
 
@@ -890,16 +1261,19 @@ public:
     virtual string getFieldPath(TQContext& ctx) {
         return getFieldName(&ctx);
     }
+    virtual const FieldPath* getConstPath() const {return expr?NULL:&path;}
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 private:
     
     std::string field;
+    FieldPath path;
     TExpressionP expr;
 };
 
 class TExprChangepath: public TExpression
 {
 public:
-    TExprChangepath(const TExpressionP& e, Operator o): exp(e), op(o) {}
+    TExprChangepath(const TExpressionP& e, Operator o);
 
     virtual bool isJSON(TQContext* ctx) {return exp->isJSON();}
     virtual bool isString(TQContext* ctx) {return exp->isString();}
@@ -914,6 +1288,8 @@ public:
     virtual double getDouble(TQContext& ctx);
     virtual bool getBool(TQContext& ctx);
     virtual string getFieldPath(TQContext& ctx);
+    virtual const FieldPath* getConstPath() const {return const_path?&path:NULL;}
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 
 private:
     void adjustPath(TQContext& ctx);
@@ -922,6 +1298,8 @@ private:
     TExpressionP exp;
     // If toRoot is true, change to root, otherwise, change one level up
     Operator op;
+    bool const_path = false;
+    FieldPath path;
 };
 
 class TExprITE: public TExpression
@@ -933,6 +1311,7 @@ public:
     virtual JSONValueP getJSON(TQContext& ctx);
     virtual bool isAggregate(TQContext* ctx)
         {return th->isAggregate(ctx)||el->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 
 private:
     TQConditionP cond;
@@ -948,6 +1327,8 @@ public:
     virtual bool isLiteral() const {return true;}
     virtual string getString(TQContext& ctx)
         {return str;}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
+    const string& value() const {return str;}
 private:
     string str;
 };
@@ -964,6 +1345,8 @@ public:
         {return val;}
     virtual string getString(TQContext& ctx)
         {return std::to_string(val);}
+    int value() const {return val;}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
 
 private:
     int val;
@@ -995,6 +1378,7 @@ public:
     virtual bool isLiteral() const {return true;}
     virtual bool getBool(TQContext& ctx)
         {return val;}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
 private:
     bool val;
 };
@@ -1006,6 +1390,7 @@ public:
     virtual bool isJSON(TQContext* ctx) {return true;}
     virtual JSONValueP getJSON(TQContext& ctx)
         {return val;}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
 private:
     JSONValueP val;
 };
@@ -1035,6 +1420,7 @@ public:
         : exp(e), lower(lower_) {}
 
     virtual string getString(TQContext& ctx);
+    virtual void collectFields(FieldUsage& used, bool at_root) const {exp->collectFields(used, at_root);}
 
     TExpressionP exp;
     bool lower;
@@ -1045,6 +1431,7 @@ class TExprPath: public TExprString
 {
 public:
     virtual string getString(TQContext& ctx);
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
 };
 
 class TExprIndex: public TExpression
@@ -1053,6 +1440,7 @@ public:
     virtual bool isInt(TQContext* ctx) {return true;}
     virtual string getString(TQContext& ctx);
     virtual int64_t getInt(TQContext&ctx);
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
 };
 
 
@@ -1064,6 +1452,7 @@ public:
         return escape_field_name(getString(ctx));
     }
     virtual bool isSortedKey() const {return false;}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
 };
 
 class TExprReskey: public TExprString
@@ -1074,12 +1463,14 @@ public:
         return escape_field_name(getString(ctx));
     }
     virtual bool isSortedKey() const {return false;}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
 };
 
 class TExprFilename: public TExprString
 {
 public:
     virtual string getString(TQContext& ctx);
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
 };
 
 class TExprEnv: public TExprString
@@ -1175,6 +1566,7 @@ public:
     virtual string getString(TQContext& ctx);
     virtual bool isAggregate(TQContext* ctx)
         {return arg1->isAggregate(ctx)||arg2->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 private:
     TExpressionP arg1;
     TExpressionP arg2;
@@ -1190,6 +1582,7 @@ public:
     virtual string getString(TQContext& ctx);
     virtual bool isAggregate(TQContext* ctx)
         {return str->isAggregate(ctx)||start->isAggregate(ctx)||(length&&length->isAggregate(ctx));}
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 
 private:
     TExpressionP str;
@@ -1206,6 +1599,7 @@ public:
         {return str->isAggregate(ctx)||searched->isAggregate(ctx);}
     virtual bool isJSON(TQContext* ctx) {return true;}
     virtual JSONValueP getJSON(TQContext& ctx);
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 
 private:
     TExpressionP str;
@@ -1221,6 +1615,7 @@ public:
     virtual string getString(TQContext& ctx);
     virtual bool isAggregate(TQContext* ctx)
         {return source->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 
 private:
     TExpressionP source;
@@ -1232,10 +1627,8 @@ private:
 class TExprSubfield: public TExpression
 {
 public:
-    TExprSubfield(const TExpressionP& x, const string& spath)
-        : arg(x), subpath(spath) {}
-    TExprSubfield(const TExpressionP& x, const TExpressionP& e, bool index)
-        : arg(x), expr(e), is_index(index) {}
+    TExprSubfield(const TExpressionP& x, const string& spath);
+    TExprSubfield(const TExpressionP& x, const TExpressionP& e, bool index);
     virtual bool isAggregate(TQContext* ctx)
         {return arg->isAggregate(ctx);}
     virtual bool isJSON(TQContext* ctx) {return true;}
@@ -1253,13 +1646,19 @@ public:
     virtual bool getBool(TQContext& ctx);
 
     virtual string getFieldPath(TQContext& ctx);
+    virtual const FieldPath* getConstPath() const {return const_path?&path:NULL;}
 
     string getSubpath(TQContext& ctx);
+    virtual void collectFields(FieldUsage& used, bool at_root) const;
 private:
+    void compilePath();
+
     TExpressionP arg;
     string subpath;
     TExpressionP expr;
-    bool is_index;
+    bool is_index = false;
+    bool const_path = false;
+    FieldPath path;
 };
 
 class TExprSize: public TExpression
@@ -1269,6 +1668,7 @@ public:
     virtual bool isInt(TQContext* ctx) {return true;}
     virtual bool isAggregate(TQContext* ctx)
         {return array->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {array->collectFields(used, at_root);}
     
     virtual int64_t getInt(TQContext& ctx);
 
@@ -1283,6 +1683,7 @@ public:
     virtual bool isInt(TQContext* ctx) {return true;}
     virtual bool isAggregate(TQContext* ctx)
         {return str->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {str->collectFields(used, at_root);}
     
     virtual int64_t getInt(TQContext& ctx);
 
@@ -1299,6 +1700,10 @@ public:
     virtual JSONValueP getJSON(TQContext& ctx);
     virtual bool isAggregate(TQContext* ctx)
         {return expr->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {
+        expr->collectFields(used, at_root);
+        delim->collectFields(used, at_root);
+    }
 
 private:
     TExpressionP expr;
@@ -1313,6 +1718,10 @@ public:
     virtual string getString(TQContext& ctx);
     virtual bool isAggregate(TQContext* ctx)
         {return expr->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {
+        expr->collectFields(used, at_root);
+        delim->collectFields(used, at_root);
+    }
 
 private:
     TExpressionP expr;
@@ -1336,6 +1745,7 @@ public:
     virtual int64_t getInt(TQContext& ctx);    
     virtual bool isAggregate(TQContext* ctx)
         {return expr->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {expr->collectFields(used, at_root);}
 
 private:
     TExpressionP expr;
@@ -1350,6 +1760,7 @@ public:
     virtual string getString(TQContext& ctx);    
     virtual bool isAggregate(TQContext* ctx)
         {return expr->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {expr->collectFields(used, at_root);}
 
 private:
     TExpressionP expr;
@@ -1385,6 +1796,7 @@ public:
     virtual bool isBool(TQContext* ctx) {return t==CastType::Bool;}
     virtual bool isAggregate(TQContext* ctx)
         {return arg->isAggregate(ctx);}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {arg->collectFields(used, at_root);}
     virtual string getString(TQContext& ctx);
     virtual int64_t getInt(TQContext& ctx);
     virtual double getDouble(TQContext& ctx);
@@ -1405,12 +1817,12 @@ public:
     virtual bool isDouble(TQContext* ctx) {return is_double;}
     virtual int64_t getInt(TQContext& ctx) {return {};};
     virtual double getDouble(TQContext& ctx) {return {};}
+    // Combine with the state of the same aggregate function, calculated over a different set of values
+    virtual void merge(const TQAggregateDataP& other) {}
 
     bool is_double = false;
 };
 
-typedef std::shared_ptr<TQAggregateData> TQAggregateDataP;
-
 class TExprAggregate: public TExpression
 {
 public:
@@ -1419,17 +1831,15 @@ public:
     virtual bool isDouble(TQContext* ctx);
     virtual int64_t getInt(TQContext& ctx);
     virtual double getDouble(TQContext& ctx);
-    virtual TQAggregateDataP getData(TQContext& ctx);
+    virtual const TQAggregateDataP& getData(TQContext& ctx);
     virtual TQAggregateDataP makeData() = 0;
-
-protected:
-    std::map<TQData*,TQAggregateDataP> data_map;
 };
 
 class TExprCount: public TExprAggregate
 {
 public:
     virtual TQAggregateDataP makeData();
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
 };
 
 class TExprCountData: public TQAggregateData
@@ -1437,6 +1847,7 @@ class TExprCountData: public TQAggregateData
 public:
     TExprCountData(TExprCount* e) : TQAggregateData(false), expr(e) {}
     virtual int64_t getInt(TQContext& ctx);
+    virtual void merge(const TQAggregateDataP& other);
 private:
     TExprCount* expr;
     int64_t count = 0;
@@ -1447,6 +1858,7 @@ class TExprSum: public TExprAggregate
 public:
     TExprSum(const TExpressionP& x): arg(x) {}
     virtual TQAggregateDataP makeData();
+    virtual void collectFields(FieldUsage& used, bool at_root) const {arg->collectFields(used, at_root);}
     virtual bool isDouble(TQContext* ctx);
 
     TExpressionP arg;
@@ -1458,6 +1870,7 @@ public:
     TExprSumData(TExprSum* e) : expr(e) {}
     virtual int64_t getInt(TQContext& ctx);
     virtual double getDouble(TQContext& ctx);
+    virtual void merge(const TQAggregateDataP& other);
 private:
     TExprSum* expr;
     int64_t sum = 0;
@@ -1469,6 +1882,7 @@ class TExprAvg: public TExprAggregate
 public:
     TExprAvg(const TExpressionP& x): arg(x) {}
     virtual TQAggregateDataP makeData();
+    virtual void collectFields(FieldUsage& used, bool at_root) const {arg->collectFields(used, at_root);}
     virtual bool isInt(TQContext* ctx) {return false;}
     virtual bool isDouble(TQContext* ctx) {return true;}
 
@@ -1481,6 +1895,7 @@ public:
     TExprAvgData(TExprAvg* e) : TQAggregateData(true), expr(e) {}
     virtual int64_t getInt(TQContext& ctx);
     virtual double getDouble(TQContext& ctx);
+    virtual void merge(const TQAggregateDataP& other);
 private:
     TExprAvg* expr;
     double sum = 0;
@@ -1492,6 +1907,7 @@ class TExprMinmax: public TExprAggregate
 public:
     TExprMinmax(bool flag, const TExpressionP& x): arg(x), max(flag) {}
     virtual TQAggregateDataP makeData();
+    virtual void collectFields(FieldUsage& used, bool at_root) const {arg->collectFields(used, at_root);}
     virtual bool isDouble(TQContext* ctx);
 
     TExpressionP arg;
@@ -1504,6 +1920,7 @@ public:
     TExprMinmaxData(TExprMinmax* e): expr(e) {}
     virtual int64_t getInt(TQContext& ctx);
     virtual double getDouble(TQContext& ctx);
+    virtual void merge(const TQAggregateDataP& other);
 private:
     TExprMinmax* expr;
     int64_t num = 0;
@@ -1545,7 +1962,6 @@ public:
     }
 
 protected:
-    std::map<TQData*,TQDataP> data_map;
     string proc;
     std::vector<TExpressionP> args;
 };
@@ -1554,6 +1970,7 @@ class TExprVar: public TExpression
 {
 public:
     TExprVar(const string& s): name(s) {}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {}
     virtual bool isJSON(TQContext* ctx) {return true;}
     virtual bool isString(TQContext* ctx);
     virtual bool isDouble(TQContext* ctx);
@@ -1582,7 +1999,26 @@ public:
     string getFilename(TQContext& ctx);
 protected:
     TExpressionP filename;
-    JSONValueP json;
+};
+
+// $lookup(source, 'key-path', value): an equality join with the array source, which returns the first element 
+// whose value at key-path is the same as value (or null)
+class TExprLookup: public TExpression
+{
+public:
+    TExprLookup(const TExpressionP& s, const string& kp, const TExpressionP& v)
+        : source(s), key_path(compilePath(kp)), value(v) {}
+    virtual bool isJSON(TQContext* ctx) {return true;}
+    virtual JSONValueP getJSON(TQContext& ctx);
+    virtual bool exists(TQContext& ctx) {return !getJSON(ctx)->IsNull();}
+    virtual void collectFields(FieldUsage& used, bool at_root) const {
+        source->collectFields(used, at_root);
+        value->collectFields(used, at_root);
+    }
+protected:
+    TExpressionP source;
+    PathSteps key_path;
+    TExpressionP value;
 };
 
 class TExprCSV: public TExprFile
@@ -5,6 +5,12 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <string_view>
 #include "rapidjson/document.h"
 
 typedef rapidjson::Value JSONValue;
@@ -37,10 +43,24 @@ private:
     std::vector<std::string> fields;
 };
 
+// A null value shared by all the lookups that find nothing, instead of allocating a new one each time.
+// It must not be modified.
+const JSONValueP& nullJSON();
+
+// Hashing that is consistent with JSONValue::operator== (e.g. 1 and 1.0 are equal)
+struct JSONHash {
+    size_t operator()(const JSONValue* v) const;
+};
+struct JSONEqual {
+    bool operator()(const JSONValue* a, const JSONValue* b) const {return *a==*b;}
+};
+
 std::string valToString(const JSONValue* val);
 
 std::string valToString(const JSONValueP& val);
 
+double valToDouble(const JSONValue* val);
+
 double valToDouble(const JSONValueP& val);
 
 int64_t valToInt(const JSONValueP& val);
@@ -51,6 +71,185 @@ std::string joinAllVals(const JSONValue& val, const std::string& delim);
 
 JSONValueP readCSV(std::istream& is, const std::string& delim, bool with_header);
 
+// Reads a CSV file one row at a time. Fields may be quoted as in RFC 4180, in which case they may contain 
+// delimiters, line breaks and doubled quotes.
+class CSVReader
+{
+public:
+    // The column names are copied once into key_alloc if given, so that the rows can outlive the reader.
+    // Otherwise the rows refer to the reader's copy of the column names.
+    CSVReader(
+        std::istream& is, 
+        const std::string& delim, 
+        bool with_header, 
+        JSONValue::AllocatorType* key_alloc = nullptr);
+
+    // Read the next non-empty row into an object whose keys are the column names (or the column numbers, 
+    // for columns without a name). Returns false at the end of the input.
+    bool nextRow(JSONValue& row, JSONValue::AllocatorType& alloc);
+
+private:
+    bool nextRecord();
+    void addColumn(std::string name);
+
+    std::istream& is;
+    std::string delim;
+    JSONValue::AllocatorType* key_alloc;
+    std::deque<std::string> columns;
+    std::vector<std::string_view> keys;
+    // The current record, with quoted fields unescaped in place, and the position and length of each field
+    std::string line;
+    std::vector<std::pair<size_t, size_t> > fields;
+};
+
+// A cache of documents parsed from files, such as the files read by $file and $csv, shared by all threads.
+// An entry is used only while the file's size and modification time are unchanged, and the least recently 
+// used entries are evicted when the total memory of the cached documents exceeds the limit.
+// The cached documents are shared, so they must not be modified.
+class DocumentCache
+{
+public:
+    static DocumentCache& instance();
+
+    // Limit on the memory of the cached documents, in bytes (0 disables the cache)
+    void setLimit(size_t bytes);
+
+    // The document parsed from the file in the given format (e.g. "json"), either from the cache or by 
+    // calling load, which returns a Document or nullJSON() if loading failed. Failures are not cached.
+    JSONValueP get(const std::string& filename, const std::string& format, const std::function<JSONValueP()>& load);
+
+private:
+    struct Entry {
+        std::string key;
+        off_t size;
+        struct timespec mtime;
+        size_t bytes;
+        JSONValueP doc;
+    };
+
+    void evict();
+
+    std::mutex mtx;
+    size_t limit = 512<<20;
+    size_t total = 0;
+    // The most recently used entry first
+    std::list<Entry> entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+};
+
+// A file mapped into memory with private (copy-on-write) pages, so that it can be parsed in situ
+// without modifying the file. Values parsed in situ refer to the mapped memory, so it must outlive them.
+class MappedFile
+{
+public:
+    MappedFile(const std::string& fname);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const {return opened;}
+    char* begin() {return buf;}
+    char* end() {return buf+len;}
+private:
+    char* buf = nullptr;
+    size_t len = 0;
+    bool opened = false;
+};
+
+// Stream for in-situ parsing of a buffer that is not null-terminated (same as rapidjson's InsituStringStream,
+// but reads '\0' at the end of the buffer)
+class InsituBufferStream
+{
+public:
+    typedef char Ch;
+
+    InsituBufferStream(Ch* b, Ch* e): src(b), dst(nullptr), head(b), tail(e) {}
+
+    Ch Peek() const {return (src<tail)?*src:'\0';}
+    Ch Take() {return (src<tail)?*src++:'\0';}
+    size_t Tell() const {return static_cast<size_t>(src-head);}
+
+    void Put(Ch c) {*dst++ = c;}
+    Ch* PutBegin() {return dst = src;}
+    size_t PutEnd(Ch* begin) {return static_cast<size_t>(dst-begin);}
+    void Flush() {}
+
+    Ch* Push(size_t count) {Ch* begin = dst; dst += count; return begin;}
+    void Pop(size_t count) {dst -= count;}
+#ifdef RAPIDJSON_SIMD
+    void SkipWhitespace() {src = const_cast<Ch*>(rapidjson::SkipWhitespace_SIMD(src, tail));}
+#endif
+private:
+    Ch* src;
+    Ch* dst;
+    Ch* head;
+    Ch* tail;
+};
+
+// Destination of the query result, written as a stream of events without building it as a JSON value first.
+// It has the interface of a rapidjson handler, so a JSONValue can be written with Accept().
+class JSONOutput
+{
+public:
+    typedef char Ch;
+    virtual ~JSONOutput() {}
+    virtual bool Null() = 0;
+    virtual bool Bool(bool b) = 0;
+    virtual bool Int(int i) = 0;
+    virtual bool Uint(unsigned u) = 0;
+    virtual bool Int64(int64_t i) = 0;
+    virtual bool Uint64(uint64_t u) = 0;
+    virtual bool Double(double d) = 0;
+    virtual bool RawNumber(const Ch* str, rapidjson::SizeType length, bool copy) = 0;
+    virtual bool String(const Ch* str, rapidjson::SizeType length, bool copy) = 0;
+    virtual bool StartObject() = 0;
+    virtual bool Key(const Ch* str, rapidjson::SizeType length, bool copy) = 0;
+    virtual bool EndObject(rapidjson::SizeType member_count) = 0;
+    virtual bool StartArray() = 0;
+    virtual bool EndArray(rapidjson::SizeType element_count) = 0;
+
+    bool Key(const std::string& key) {return Key(key.c_str(), key.size(), false);}
+};
+
+// JSONOutput to a rapidjson writer (Writer or PrettyWriter)
+template<typename Writer>
+class JSONWriterOutput: public JSONOutput
+{
+public:
+    JSONWriterOutput(Writer& w): writer(w) {}
+    using JSONOutput::Key;
+    virtual bool Null() {return writer.Null();}
+    virtual bool Bool(bool b) {return writer.Bool(b);}
+    virtual bool Int(int i) {return writer.Int(i);}
+    virtual bool Uint(unsigned u) {return writer.Uint(u);}
+    virtual bool Int64(int64_t i) {return writer.Int64(i);}
+    virtual bool Uint64(uint64_t u) {return writer.Uint64(u);}
+    virtual bool Double(double d) {return writer.Double(d);}
+    virtual bool RawNumber(const Ch* str, rapidjson::SizeType length, bool copy) {return writer.RawNumber(str, length, copy);}
+    virtual bool String(const Ch* str, rapidjson::SizeType length, bool copy) {return writer.String(str, length, copy);}
+    virtual bool StartObject() {return writer.StartObject();}
+    virtual bool Key(const Ch* str, rapidjson::SizeType length, bool copy) {return writer.Key(str, length, copy);}
+    virtual bool EndObject(rapidjson::SizeType member_count) {return writer.EndObject(member_count);}
+    virtual bool StartArray() {return writer.StartArray();}
+    virtual bool EndArray(rapidjson::SizeType element_count) {return writer.EndArray(element_count);}
+private:
+    Writer& writer;
+};
+
 } // namespace xcite
 
+namespace rapidjson {
+template <>
+struct StreamTraits<xcite::InsituBufferStream> {
+    enum { copyOptimization = 1 };
+};
+
+#ifdef RAPIDJSON_SIMD
+//! Template function specialization for InsituBufferStream
+template<> inline void SkipWhitespace(xcite::InsituBufferStream& is) {
+    is.SkipWhitespace();
+}
+#endif // RAPIDJSON_SIMD
+} // namespace rapidjson
+
 #endif // JSON_UTILS_H
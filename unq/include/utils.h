@@ -3,7 +3,11 @@
 #ifndef UTILS_H_INCLUDED
 #define UTILS_H_INCLUDED
 #include <string>
+#include <string_view>
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 
 namespace xcite {
 
@@ -33,7 +37,7 @@ std::string get_identifier_part(const std::string& name, const std::string& des)
 // Note: returns true in case its a number, a number and letters combinations (e.g. 10A), a roman numeral, or a letter numeral
 bool isNumOrNumeral(const std::string& s);
 
-bool is_number(const std::string& s);
+bool is_number(std::string_view s);
 
 size_t find_gen_amendment(const std::string& s);
 
@@ -77,6 +81,47 @@ std::string timeToString(time_t t, const std::string& f);
 
 std::vector<std::string> split_string(const std::string& s, const std::string& delim);
 
+// A FIFO queue for passing items between threads. push() blocks while the queue is full, and pop() blocks
+// while it is empty, until an item arrives or the queue is closed.
+template <typename T>
+class BoundedQueue
+{
+public:
+    BoundedQueue(size_t c): capacity(c) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_full.wait(lock, [&]{return items.size()<capacity;});
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+    }
+    // Returns false if the queue is closed and there are no more items
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_empty.wait(lock, [&]{return !items.empty() || closed;});
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+    void close() {
+        std::lock_guard<std::mutex> lock(mtx);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mtx;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
 } // namespace xcite
 
 #endif // UTILS_H_INCLUDED
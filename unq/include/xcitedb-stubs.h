@@ -10,6 +10,9 @@
 typedef std::string string;
 typedef rapidjson::Value JSONValue;
 
+// The database classes are only stubs, so the query engine can be compiled for local JSON only
+#define UNQ_LOCAL_JSON_ONLY
+
 class WhatEver
 {
 };
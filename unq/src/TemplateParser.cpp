@@ -154,6 +154,15 @@ void TParser::throwError(const string& msg)
     throw ParsingError("Error at: "+err+"\n"+msg);
 }
 
+void TParser::checkRegex(const string& pattern)
+{
+    try {
+        std::regex re(pattern);
+    } catch (std::regex_error& e) {
+        throwError("Invalid regular expression \""+pattern+"\"");
+    }
+}
+
 TQKeyP TParser::key()
 {
     TQKeyP res;
@@ -177,6 +186,7 @@ TQKeyP TParser::key()
         if (next=="}") {
             res = TQKeyP(new TQRegexKey(stripQuotes_("")));
         } else if (isQuoted(next)) {
+            checkRegex(stripQuotes_(next));
             res = TQKeyP(new TQRegexKey(stripQuotes_(next)));
             expect("}");
         } else {
@@ -267,6 +277,7 @@ TemplateQueryP TParser::context_mod(bool frame_flag, ContextModMode parse_mode)
         mode = ContextMode::Regex;
         if(!ifNext("}")) {
             context = stripQuotes_(nextToken());
+            checkRegex(context);
             expect("}");
         } else {
             context.clear();
@@ -399,6 +410,7 @@ ValueAndCond TParser::value()
 
     OrderType order_type = OrderType::None;
     int order_num = 0;
+    size_t order_limit = 0;
 
     if (ifNext("?")) {
         cond = condition();
@@ -424,11 +436,18 @@ ValueAndCond TParser::value()
             order_num = stoll(nextToken());
             expect(")");
         }
+        if (ifNext("limit")) {
+            string n = nextToken();
+            if (n.empty() || n.find_first_not_of("0123456789")!=string::npos || stoull(n)==0) {
+                throwError("Expected a positive number after limit");
+            }
+            order_limit = stoull(n);
+        }
     }
     if (!eos()) {
         throwError("Could not parse text at the end");
     }
-    res.first = TemplateQueryP(new TQValue(exp, order_type, order_num));
+    res.first = TemplateQueryP(new TQValue(exp, order_type, order_num, order_limit));
     if (cond) {
         res.first = TemplateQueryP(new TQValueWithCond(res.first, cond));
     }
@@ -489,6 +508,10 @@ TQConditionP TParser::baseCondition(const TExpressionP& arg1)
     } else if (op=="ends_with") {
         return TQConditionP(new TQStringTest(lhs, rhs, Operator::ENDS));
     } else if (op=="matches") {
+        const TExprStringConst* pattern = dynamic_cast<const TExprStringConst*>(rhs.get());
+        if (pattern) {
+            checkRegex(pattern->value());
+        }
         return TQConditionP(new TQStringTest(lhs, rhs, Operator::MATCH));
     } else if (op=="=") {
         return TQConditionP(new TQCompareTest(lhs, rhs, Operator::EQ));
@@ -624,6 +647,15 @@ TExpressionP TParser::baseExpression()
         }
         expect(")");
         res = TExpressionP(new TExprCSV(exp, delim, header));
+    } else if (token=="$lookup") {
+        expect("(");
+        TExpressionP src = expression();
+        expect(",");
+        string key_path = stripQuotes_(nextToken());
+        expect(",");
+        TExpressionP val = expression();
+        expect(")");
+        res = TExpressionP(new TExprLookup(src, key_path, val));
     } else if (token=="$prev") {
         expect("(");
         TExpressionP def = expression();
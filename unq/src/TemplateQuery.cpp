@@ -6,6 +6,8 @@
 #include "rapidjson/document.h"
 #include <rapidjson/ostreamwrapper.h>
 #include "rapidjson/filereadstream.h"
+#include "rapidjson/filewritestream.h"
+#include "rapidjson/writer.h"
 #include "rapidjson/error/en.h"
 #include <regex>
 #include <iostream>
@@ -13,6 +15,9 @@
 #include <csignal>
 #include <sstream>
 #include <fstream>
+#include <queue>
+#include <cmath>
+#include <cstring>
 
 using namespace std;
 using namespace rapidjson;
@@ -20,6 +25,7 @@ using namespace rapidjson;
 namespace xcite {
 
 std::vector<std::map<TQData*,TQDataP> > TQShared::data_map;
+std::mutex TQShared::data_map_mutex;
 
 
 TQContext::TQContext()
@@ -52,6 +58,8 @@ void TQContext::reset(const string& identifier, const string& index)
     local_json_frames.clear();
     localJSONs.clear();
     localDocs.clear();
+    local_generation++;
+    scratch.Clear();
     if (!identifier.empty()) {
         pushIdentifier(identifier, index);
     }
@@ -61,6 +69,7 @@ void TQContext::reset(const string& identifier, const string& index)
         pushBranch(tr->getBranch());
     }
     in_local = false;
+    local_generation++;
 }
 
 JSONValueP TQContext::addVar(const string& s, const JSONValueP& j)
@@ -80,10 +89,9 @@ JSONValueP TQContext::assignVar(const string& s, const JSONValueP& j)
 
 JSONValueP TQContext::getVar(const string& s)
 {
-    static JSONValueP nullJSON(new JSONValue);
     auto it = variables.find(s);
     if (it==variables.end() || it->second.empty()) {
-        return nullJSON;
+        return nullJSON();
     }
     return it->second.back();
 }
@@ -101,7 +109,25 @@ Function& TQContext::getFunc(const string& name)
 
 void TQContext::pushPath(const string& path)
 {
-    paths.push_back(path);
+    paths.emplace_back(PathEntry::Type::Full, -1, path);
+}
+
+const string& TQContext::pathAt(int i)
+{
+    if (i<0) {
+        return empty_string;
+    }
+    PathEntry& entry = paths[i];
+    if (!entry.built) {
+        const string& base = pathAt(entry.base);
+        if (entry.type==PathEntry::Type::Index) {
+            entry.step = base+"["+to_string(entry.index)+"]";
+        } else {
+            entry.step = fullPath(entry.step, base);
+        }
+        entry.built = true;
+    }
+    return entry.step;
 }
 
 void TQContext::adjustPath(const string& path)
@@ -110,6 +136,7 @@ void TQContext::adjustPath(const string& path)
     if (in_local) {
         JSONValueP val = findLocalPath(path, localDocs.back(), true);
         localJSONs.push_back(val);
+        local_generation++;
     }
 }
 
@@ -118,8 +145,33 @@ void TQContext::addToPath(const string& added)
     if (in_local) {
         JSONValueP val = findLocalPath(added);
         localJSONs.push_back(val);
+        local_generation++;
     }
-    pushPath(fullPath(added));
+    paths.emplace_back(PathEntry::Type::Relative, (int)paths.size()-1, added);
+}
+
+void TQContext::addToPath(const FieldPath& added)
+{
+    if (in_local) {
+        JSONValueP val = resolvePath(added);
+        localJSONs.push_back(val);
+        local_generation++;
+    }
+    paths.emplace_back(PathEntry::Type::Relative, (int)paths.size()-1, added.str());
+}
+
+void TQContext::addIndexToPath(int index)
+{
+    if (in_local) {
+        const JSONValueP& array = localJSONs.back();
+        if (array->IsArray() && index>=0 && array->Size()>(unsigned)index) {
+            localJSONs.push_back(JSONValueP(array, &array->GetArray()[index]));
+        } else {
+            localJSONs.push_back(nullJSON());
+        }
+        local_generation++;
+    }
+    paths.emplace_back(PathEntry::Type::Index, (int)paths.size()-1, empty_string, index);
 }
 
 void TQContext::pushIdentifier(const string& identifier, const string& index)
@@ -149,12 +201,14 @@ void TQContext::startLocalJSON(const JSONValueP& json)
     localJSONs.push_back(json);
     localDocs.push_back(json);
     in_local = true;
+    local_generation++;
 }
 
 void TQContext::endLocalJSON()
 {
     popJSON();
     localDocs.pop_back();
+    local_generation++;
 }
 
 void TQContext::pushData(TQData* data)
@@ -205,6 +259,7 @@ void TQContext::popBranch()
 void TQContext::popJSON()
 {
     localJSONs.pop_back();
+    local_generation++;
     if (localJSONs.empty()) {
         in_local = false;
     }
@@ -255,8 +310,10 @@ void TQContext::pushLastFrame()
     int local = local_json_frames.back();
     if (local<0) {
         in_local = false;
+        local_generation++;
     } else {
         localJSONs.push_back(localJSONs[local]);
+        local_generation++;
     }
 }
 
@@ -272,8 +329,10 @@ void TQContext::popFrame()
     if (!localJSONs.empty()) {
         if (!in_local) {
             in_local = true;
+            local_generation++;
         } else {
             localJSONs.pop_back();
+            local_generation++;
         }
     }
 }
@@ -305,79 +364,156 @@ string TQContext::fullPath(const string& subpath, string currpath)
 }
 
 
-JSONValueP TQContext::findLocalPath(const string& path, JSONValueP val, bool allow_projection)
+FieldPath::FieldPath(const string& p): path(p), path_steps(compilePath(p))
 {
-    if (val->IsNull()) {
-        return JSONValueP(new JSONValue);
+    static std::atomic<size_t> last_id(0);
+    path_id = ++last_id;
+}
+
+// Follow a path for finding the top-level fields it uses, updating at_root to whether the path may end
+// at the root of the document. "../" may go up to any of the enclosing contexts, including the root.
+static void followPath(const PathSteps& steps, FieldUsage& used, bool& at_root)
+{
+    for (const PathStep& step: steps) {
+        switch (step.type) {
+        case PathStep::Type::Root:
+        case PathStep::Type::Up:
+            at_root = true;
+            break;
+        case PathStep::Type::Member:
+            if (at_root) {
+                used.add(step.name);
+            }
+            at_root = false;
+            break;
+        case PathStep::Type::Index:
+            at_root = false;
+            break;
+        }
     }
-    if (path.empty() || path==".") {
-        return val;
+}
+
+// Same as above, for a path whose value is read
+static void readPath(const PathSteps& steps, FieldUsage& used, bool at_root)
+{
+    followPath(steps, used, at_root);
+    if (at_root) {
+        // Reading the whole document
+        used.addAll();
     }
-    if (path[0]=='/') {
-        return findLocalPath(path.substr(1), localDocs.back(), allow_projection);
+}
+
+std::regex compileRegex(const string& pattern)
+{
+    return std::regex(pattern, std::regex::ECMAScript|std::regex::optimize);
+}
+
+PathSteps compilePath(const string& p)
+{
+    PathSteps path_steps;
+    string rest = p;
+    while (!rest.empty() && rest!=".") {
+        if (rest[0]=='/') {
+            path_steps.emplace_back(PathStep::Type::Root);
+            rest = rest.substr(1);
+        } else if (rest.compare(0,3,"../")==0) {
+            path_steps.emplace_back(PathStep::Type::Up);
+            rest = rest.substr(3);
+        } else break;
     }
-    if (path.compare(0,3,"../")==0) {
-        int i = localJSONs.size()-2;
-        while (i>=0 && localJSONs[i]->IsArray()) {
-            i--;
-        }
-        if (i<0) {
-            return JSONValueP(new JSONValue);
-        }
-        return findLocalPath(path.substr(3), localJSONs[i], allow_projection);
+    if (rest.empty() || rest==".") {
+        return path_steps;
     }
 
     size_t i = 0;
-    size_t len = path.size();
+    size_t len = rest.size();
     while (i!=string::npos && i<len) {
-        if (path[i]=='.'|| path[i]=='[') {
+        if (rest[i]=='.'|| rest[i]=='[') {
             i++;
         }
-        size_t next = path.find_first_of(".[]", i);
-        string f = (next==string::npos)?path.substr(i):path.substr(i,next-i);
+        size_t next = rest.find_first_of(".[]", i);
+        string f = (next==string::npos)?rest.substr(i):rest.substr(i,next-i);
         f = unescape_field_name(f);
-        if (i>0 && path[i-1]=='[') {
-            if (!val->IsArray()) {
-                return JSONValueP(new JSONValue);
-            }
-            int inx = stoi(f);
-            if (val->Size()<=inx) {
-                return JSONValueP(new JSONValue);
-            }
-            val = JSONValueP(&val->GetArray()[inx], DontDeleteJSONValue());
+        if (i>0 && rest[i-1]=='[') {
+            int inx = (!f.empty() && (isdigit(f[0]) || f[0]=='-'))?stoi(f):-1;
+            path_steps.emplace_back(PathStep::Type::Index, string(), inx);
             next++;
         } else {
+            path_steps.emplace_back(PathStep::Type::Member, f);
+        }
+        i = next;
+    }
+    return path_steps;
+}
+
+JSONValueP TQContext::findLocalPath(const string& path, JSONValueP val, bool allow_projection)
+{
+    return findLocalPath(compilePath(path), val, allow_projection);
+}
+
+JSONValueP TQContext::findLocalPath(const PathSteps& steps, JSONValueP val, bool allow_projection)
+{
+    for (const PathStep& step: steps) {
+        if (val->IsNull()) {
+            return nullJSON();
+        }
+        switch (step.type) {
+        case PathStep::Type::Root:
+            val = localDocs.back();
+            break;
+        case PathStep::Type::Up: {
+            int i = localJSONs.size()-2;
+            while (i>=0 && localJSONs[i]->IsArray()) {
+                i--;
+            }
+            if (i<0) {
+                return nullJSON();
+            }
+            val = localJSONs[i];
+            break;
+        }
+        case PathStep::Type::Index:
+            if (!val->IsArray() || step.index<0 || val->Size()<=(unsigned)step.index) {
+                return nullJSON();
+            }
+            // Share ownership with the containing value, instead of allocating a new control block
+            val = JSONValueP(val, &val->GetArray()[step.index]);
+            break;
+        case PathStep::Type::Member: {
+            JSONValue name(rapidjson::StringRef(step.name.data(), step.name.size()));
             if (allow_projection && val->IsArray() && !val->GetArray().Empty()) {
-                JSONValueP newval(new JSONValue(rapidjson::kArrayType));
+                JSONValueP newval = make_shared<JSONValue>(rapidjson::kArrayType);
                 for (auto& i: val->GetArray()) {
                     if (!i.IsObject()) {
                         continue;
                     }
-                    auto it = i.FindMember(f.c_str());
+                    auto it = i.FindMember(name);
                     if (it!=i.MemberEnd()) {
-                        newval->PushBack(JSONValue(it->value,doc->GetAllocator()), doc->GetAllocator());
+                        newval->PushBack(JSONValue(it->value,scratch), scratch);
                     }
                 }
                 val = newval;
             } else if (!val->IsObject()) {
-                return JSONValueP(new JSONValue);
+                return nullJSON();
             } else {
-                auto it = val->FindMember(f.c_str());
+                auto it = val->FindMember(name);
                 if (it!=val->MemberEnd()) {
-                    val = JSONValueP(&it->value, DontDeleteJSONValue());
-                } else return JSONValueP(new JSONValue);
+                    val = JSONValueP(val, &it->value);
+                } else return nullJSON();
             }
+            break;
         }
-
-        i = next;
+        }
+    }
+    if (val->IsNull()) {
+        return nullJSON();
     }
     return val;
-
 }
 
 bool TQContext::isObject(const string& key)
 {
-    if (in_local) {
+    if (readLocal()) {
         JSONValueP val = findLocalPath(key);
         return val->IsObject();
     }
@@ -389,7 +525,7 @@ bool TQContext::isObject(const string& key)
 
 bool TQContext::isArray(const string& key)
 {
-    if (in_local) {
+    if (readLocal()) {
         JSONValueP val = findLocalPath(key);
         return val->IsArray();
     }
@@ -401,7 +537,7 @@ bool TQContext::isArray(const string& key)
 
 bool TQContext::isString(const string& key)
 {
-    if (in_local) {
+    if (readLocal()) {
         JSONValueP val = findLocalPath(key);
         return val->IsString();
     }
@@ -414,7 +550,7 @@ bool TQContext::isString(const string& key)
 
 bool TQContext::isDouble(const string& key)
 {
-    if (in_local) {
+    if (readLocal()) {
         JSONValueP val = findLocalPath(key);
         return val->IsDouble();
     }
@@ -426,7 +562,7 @@ bool TQContext::isDouble(const string& key)
 
 bool TQContext::isInt(const string& key)
 {
-    if (in_local) {
+    if (readLocal()) {
         JSONValueP val = findLocalPath(key);
         return val->IsInt64();
     }
@@ -439,7 +575,7 @@ bool TQContext::isInt(const string& key)
 
 bool TQContext::isBool(const string& key)
 {
-    if (in_local) {
+    if (readLocal()) {
         JSONValueP val = findLocalPath(key);
         return val->IsBool();
     }
@@ -450,7 +586,7 @@ bool TQContext::isBool(const string& key)
 
 bool TQContext::exists(const string& key)
 {
-    if (in_local) {
+    if (readLocal()) {
         JSONValueP val = findLocalPath(key, false);
         return !val->IsNull();
     }
@@ -464,20 +600,20 @@ bool TQContext::exists(const string& key)
 JSONValueP TQContext::getJSON(const string& key)
 {
     static JSONValueP nullValue(new JSONValue);
-    if (in_local) {
+    if (readLocal()) {
         JSONValueP val = findLocalPath(key);
         return val;
     }
 
     string path = unescaped_fullPath(key);
     //json_documentP doc = make_shared<rapidjson::Document>();
-    JSONValueP value = JSONValueP(new JSONValue(tr->traverse(path, *doc)));
+    JSONValueP value = make_shared<JSONValue>(tr->traverse(path, *doc));
     return value;
 }
 
 string TQContext::getMetaKey(const string& key)
 {
-    if (in_local) {
+    if (readLocal()) {
         return {};
     }
     string path = unescaped_fullPath(key);
@@ -510,7 +646,7 @@ bool TQContext::getBool(const string& key)
 
 int TQContext::getArraySize(const string& key)
 {
-    if (in_local) {
+    if (readLocal()) {
         JSONValueP val = findLocalPath(key);
         if (val->IsArray()) {
             return val->GetArray().Size();
@@ -525,9 +661,90 @@ int TQContext::getArraySize(const string& key)
     return stoi(size_txt.substr(1,size_txt.size()-2));
 }
 
+JSONValueP TQContext::resolvePath(const FieldPath& key, bool allow_projection)
+{
+    if (key.id()==0) {
+        return findLocalPath(key.steps(), allow_projection);
+    }
+    if (key.id()>=resolved_paths.size()) {
+        resolved_paths.resize(key.id()+1);
+    }
+    ResolvedPath& resolved = resolved_paths[key.id()];
+    if (resolved.generation[allow_projection]!=local_generation) {
+        resolved.value[allow_projection] = findLocalPath(key.steps(), allow_projection);
+        resolved.generation[allow_projection] = local_generation;
+    }
+    return resolved.value[allow_projection];
+}
+
+bool TQContext::isObject(const FieldPath& key)
+{
+    if (readLocal()) {
+        return resolvePath(key)->IsObject();
+    }
+    return isObject(key.str());
+}
+
+bool TQContext::isString(const FieldPath& key)
+{
+    if (readLocal()) {
+        return resolvePath(key)->IsString();
+    }
+    return isString(key.str());
+}
+
+bool TQContext::isDouble(const FieldPath& key)
+{
+    if (readLocal()) {
+        return resolvePath(key)->IsDouble();
+    }
+    return isDouble(key.str());
+}
+
+bool TQContext::isInt(const FieldPath& key)
+{
+    if (readLocal()) {
+        return resolvePath(key)->IsInt64();
+    }
+    return isInt(key.str());
+}
+
+bool TQContext::isBool(const FieldPath& key)
+{
+    if (readLocal()) {
+        return resolvePath(key)->IsBool();
+    }
+    return isBool(key.str());
+}
+
+bool TQContext::exists(const FieldPath& key)
+{
+    if (readLocal()) {
+        return !resolvePath(key, false)->IsNull();
+    }
+    return exists(key.str());
+}
+
+JSONValueP TQContext::getJSON(const FieldPath& key)
+{
+    if (readLocal()) {
+        return resolvePath(key);
+    }
+    return getJSON(key.str());
+}
+
+int TQContext::getArraySize(const FieldPath& key)
+{
+    if (readLocal()) {
+        JSONValueP val = resolvePath(key);
+        return val->IsArray()?val->GetArray().Size():0;
+    }
+    return getArraySize(key.str());
+}
+
 ObjectFieldSet TQContext::getMembers(const string& key)
 {
-    if (in_local) {
+    if (readLocal()) {
         JSONValueP val = findLocalPath(key);
         ObjectFieldSet obj;
         if (val->IsObject()) {
@@ -543,6 +760,110 @@ ObjectFieldSet TQContext::getMembers(const string& key)
 }
 
 
+const std::regex& TQContext::getRegex(const string& pattern)
+{
+    auto it = regexes.find(pattern);
+    if (it!=regexes.end()) {
+        return it->second;
+    }
+    // Patterns may come from the data, so don't let the cache grow without limit
+    if (regexes.size()>=1000) {
+        regexes.clear();
+    }
+    return regexes.emplace(pattern, compileRegex(pattern)).first->second;
+}
+
+int TQContext::lookup(const void* owner, const JSONValueP& source, const PathSteps& key_path, const string& key)
+{
+    LookupIndex& index = lookup_indexes[owner];
+    if (!sameSource(index.source, source)) {
+        index.source = source;
+        index.positions.clear();
+        if (source->IsArray()) {
+            auto arr = source->GetArray();
+            for (int i=0; i<(int)arr.Size(); ++i) {
+                JSONValueP k = findLocalPath(key_path, JSONValueP(source, &arr[i]), false);
+                if (k->IsString() || k->IsNumber() || k->IsBool()) {
+                    index.positions.emplace(valToString(k), i);
+                }
+            }
+        }
+    }
+    auto it = index.positions.find(key);
+    return it==index.positions.end()?-1:it->second;
+}
+
+bool TQContext::inArray(const void* owner, const JSONValueP& arr, const JSONValue& value)
+{
+    if (!arr->IsArray()) {
+        return false;
+    }
+    auto elements = arr->GetArray();
+    // Hashing doesn't pay off for small arrays, or for arrays that are tested only once
+    if (elements.Size()>=16) {
+        MemberSet& set = member_sets[owner];
+        if (sameSource(set.source, arr)) {
+            if (!set.hashed) {
+                for (auto& e: elements) {
+                    set.values.insert(&e);
+                }
+                set.hashed = true;
+            }
+            return set.values.count(&value)>0;
+        }
+        set.source = arr;
+        set.hashed = false;
+        set.values.clear();
+    }
+    for (auto& e: elements) {
+        if (e==value) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TQData::writeJSON(TQContext& ctx, JSONOutput& out, const string* key)
+{
+    JSONValue val = getJSON(ctx);
+    if (val.IsNull()) {
+        return false;
+    }
+    if (key) {
+        out.Key(*key);
+    }
+    return val.Accept(out);
+}
+
+void TQData::mergeState(const TQData* other, TQContext& ctx)
+{
+    for (auto& a: other->aggregates) {
+        auto it = std::find_if(aggregates.begin(), aggregates.end(), 
+                               [&a](const auto& mine) {return mine.first==a.first;});
+        if (it==aggregates.end()) {
+            aggregates.push_back(a);
+        } else {
+            it->second->merge(a.second);
+        }
+    }
+    for (auto& c: other->calls) {
+        auto it = calls.find(c.first);
+        if (it==calls.end()) {
+            calls.insert(c);
+        } else {
+            it->second->merge(c.second, ctx);
+        }
+    }
+}
+
+void TQData::relocate(MemoryPoolAllocator<>& alloc)
+{
+    // The aggregates keep only numbers
+    for (auto& c: calls) {
+        c.second->relocate(alloc);
+    }
+}
+
 bool compare_data(const TQDataP& a, const TQDataP& b)
 {
     return a->compare(b);
@@ -560,6 +881,11 @@ Strings TQSimpleKey::getKeys(TQContext& ctx)
     return res;
 }
 
+void TQParamKey::collectFields(FieldUsage& used, bool at_root) const
+{
+    expr->collectFields(used, at_root);
+}
+
 Strings TQParamKey::getKeys(TQContext& ctx)
 {
     Strings res;
@@ -615,9 +941,31 @@ bool TQInnerValueData::equal(const TQDataP& other) const
     return innerData->equal(o->innerData);
 }
 
+void TQInnerValueData::merge(const TQDataP& other, TQContext& ctx)
+{
+    const TQInnerValueData* o = static_cast<TQInnerValueData*>(other.get());
+    mergeState(o, ctx);
+    if (!o->innerData) {
+        return;
+    }
+    if (!innerData) {
+        // Don't take the other inner data as is, since it may refer to shared data that was merged (see TQSharedData)
+        innerData = static_cast<TQInnerValue*>(getTQ())->val->makeData();
+    }
+    innerData->merge(o->innerData, ctx);
+}
+
+void TQInnerValueData::relocate(MemoryPoolAllocator<>& alloc)
+{
+    TQData::relocate(alloc);
+    if (innerData) {
+        innerData->relocate(alloc);
+    }
+}
+
 TQDataP TQContextMod::makeData()
 {
-    return TQDataP(new TQContextModData(this));
+    return make_shared<TQContextModData>(this);
 }
 
 TemplateQueryP TQContextMod::replace(const TemplateQueryP& v)
@@ -654,6 +1002,11 @@ JSONValue TQContextModData::getJSON(TQContext& ctx)
     return innerData->getJSON(ctx);
 }
 
+bool TQContextModData::writeJSON(TQContext& ctx, JSONOutput& out, const string* key)
+{
+    return innerData && innerData->writeJSON(ctx, out, key);
+}
+
 bool TQContextModData::contextMod(const TQDataP& data, TQContext& ctx)
 {
     bool res = false;
@@ -666,7 +1019,7 @@ bool TQContextModData::contextMod(const TQDataP& data, TQContext& ctx)
         if (context.empty()) {
             res = data->processData(ctx);
         } else {
-            ctx.addToPath(context);
+            ctx.addToPath(q->context_path);
             res = data->processData(ctx);
             ctx.popPath();
         }
@@ -676,23 +1029,22 @@ bool TQContextModData::contextMod(const TQDataP& data, TQContext& ctx)
         res = data->processData(ctx);
         ctx.popPath();
     } else if (mode==ContextMode::Array) {
-        int size = ctx.getArraySize(context);
-        ctx.addToPath(context);
+        int size = ctx.getArraySize(q->context_path);
+        ctx.addToPath(q->context_path);
         for (int i=0; i<size; i++) {
-            ctx.addToPath("["+to_string(i)+"]");
+            ctx.addIndexToPath(i);
             res = data->processData(ctx) || res;
             ctx.popPath();
         }
         
-        if (size == 0 && !context.empty() && context!="." && ctx.isObject(context)) {
+        if (size == 0 && !context.empty() && context!="." && ctx.isObject(q->context_path)) {
             res = data->processData(ctx);
         }
         ctx.popPath();
     } else if (mode==ContextMode::Regex) {
         ObjectFieldSet obj = ctx.getMembers({});
-        regex re(context);
         for (const string& field: obj) {
-            if (context.empty() || regex_match(field, re)) {
+            if (context.empty() || regex_match(field, q->context_regex)) {
                 ctx.addToPath(escape_field_name(field));
                 res = data->processData(ctx) || res;
                 ctx.popPath();
@@ -719,7 +1071,7 @@ bool TQContextModData::allPaths(const TQDataP& data, TQContext& ctx)
     int size = ctx.getArraySize("");
     if (size>0) {
         for (int i=0; i<size; i++) {
-            ctx.addToPath("["+to_string(i)+"]");
+            ctx.addIndexToPath(i);
             res = allPaths(data, ctx) || res;
             ctx.popPath();
         }
@@ -860,9 +1212,33 @@ bool TQContextModData::handleArrow(const TQDataP& data, TQContext& ctx)
     return res;
 }
 
+void TQContextMod::collectFields(FieldUsage& used, bool at_root) const
+{
+    switch (mode) {
+    case ContextMode::None:
+    case ContextMode::Array:
+        followPath(context_path.steps(), used, at_root);
+        break;
+    case ContextMode::Regex:
+    case ContextMode::AllPaths:
+        if (at_root) {
+            used.addAll();
+        }
+        at_root = false;
+        break;
+    default:
+        // Computed paths, the result key, or switching to other documents
+        used.addAll();
+        return;
+    }
+    if (val) {
+        val->collectFields(used, at_root);
+    }
+}
+
 TQDataP TQContextModOr::makeData()
 {
-    return TQDataP(new TQContextModOrData(this));
+    return make_shared<TQContextModOrData>(this);
 }
 
 TemplateQueryP TQContextModOr::replace(const TemplateQueryP& v)
@@ -903,6 +1279,28 @@ bool TQContextModOrData::processData(TQContext& ctx)
     return res;
 }
 
+void TQContextModOrData::merge(const TQDataP& other, TQContext& ctx)
+{
+    TQContextModOrData* o = static_cast<TQContextModOrData*>(other.get());
+    mergeState(o, ctx);
+    // Merge the data shared by all branches first, and then the branches themselves
+    TQShared::mergeShared(this, o, ctx);
+    for (int i=data.size(); i<o->data.size(); ++i) {
+        data.push_back(q->vals[i]->makeData());
+    }
+    for (int i=0; i<o->data.size(); ++i) {
+        data[i]->merge(o->data[i], ctx);
+    }
+}
+
+void TQContextModOrData::relocate(MemoryPoolAllocator<>& alloc)
+{
+    TQData::relocate(alloc);
+    for (auto& d: data) {
+        d->relocate(alloc);
+    }
+}
+
 JSONValue TQContextModOrData::getJSON(TQContext& ctx)
 {
     JSONValue res;
@@ -915,9 +1313,19 @@ JSONValue TQContextModOrData::getJSON(TQContext& ctx)
     return res;
 }
 
+bool TQContextModOrData::writeJSON(TQContext& ctx, JSONOutput& out, const string* key)
+{
+    for (auto& d: data) {
+        if (d->writeJSON(ctx, out, key)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 TQDataP TQShared::makeData()
 {
-    return TQDataP(new TQSharedData(this));
+    return make_shared<TQSharedData>(this);
 }
 
 TemplateQueryP TQShared::replace(const TemplateQueryP& v)
@@ -925,14 +1333,42 @@ TemplateQueryP TQShared::replace(const TemplateQueryP& v)
     return TemplateQueryP(new TQShared(val->replace(v), id));
 }
 
+void TQShared::mergeShared(TQData* dst, TQData* src, TQContext& ctx)
+{
+    for (auto& m: data_map) {
+        auto src_it = m.find(src);
+        if (src_it==m.end()) {
+            continue;
+        }
+        auto dst_it = m.find(dst);
+        if (dst_it==m.end()) {
+            m[dst] = src_it->second;
+        } else {
+            dst_it->second->merge(src_it->second, ctx);
+        }
+        // Any data object that still refers to src would now find the merged data
+        m[src] = m[dst];
+    }
+}
+
+void TQShared::releaseShared()
+{
+    lock_guard<mutex> lock(data_map_mutex);
+    for (auto& m: data_map) {
+        m.clear();
+    }
+}
+
 bool TQSharedData::processData(TQContext& ctx)
 {
     if (!innerData) {
+        lock_guard<mutex> lock(q->data_map_mutex);
         auto& m = q->data_map[q->id];
-        auto it = m.find(ctx.data());
+        owner = ctx.data();
+        auto it = m.find(owner);
         if (it==m.end()) {
             innerData = q->val->makeData();
-            m[ctx.data()] = innerData;
+            m[owner] = innerData;
         } else {
             innerData = it->second;
         }
@@ -941,6 +1377,16 @@ bool TQSharedData::processData(TQContext& ctx)
     return res;
 }
 
+void TQSharedData::merge(const TQDataP& other, TQContext& ctx)
+{
+    // The shared data itself was already merged by TQShared::mergeShared
+    const TQSharedData* o = static_cast<TQSharedData*>(other.get());
+    mergeState(o, ctx);
+    if (!innerData && o->owner) {
+        innerData = q->data_map[q->id][o->owner];
+    }
+}
+
 JSONValue TQSharedData::getJSON(TQContext& ctx)
 {
     if (!innerData) {
@@ -949,57 +1395,574 @@ JSONValue TQSharedData::getJSON(TQContext& ctx)
     return innerData->getJSON(ctx);
 }
 
+bool TQSharedData::writeJSON(TQContext& ctx, JSONOutput& out, const string* key)
+{
+    return innerData && innerData->writeJSON(ctx, out, key);
+}
+
+void TQContextModOr::collectFields(FieldUsage& used, bool at_root) const
+{
+    for (auto& v: vals) {
+        v->collectFields(used, at_root);
+    }
+}
+
 TQDataP TQArray::makeData()
 {
-    return TQDataP(new TQArrayData(this));
+    return make_shared<TQArrayData>(this);
 }
 
+// Creates a temporary file for sorted runs of elements
+static FILE* createRun()
+{
+    FILE* fp = tmpfile();
+    if (!fp) {
+        throw QueryError("Could not create a temporary file for sorting");
+    }
+    return fp;
+}
+
+// The maximum number of temporary files of an array, beyond which they are merged into one
+static const size_t max_runs = 64;
+
 bool TQArrayData::processData(TQContext& ctx)
 {
     bool res = false;
+    // With a memory limit for sorting, the elements of a large array keep their values in run_alloc, which is 
+    // cleared when they are written to a temporary file. Small arrays (e.g. one per group) don't get their own 
+    // allocator, which would take more memory than their elements. An array with a limit on the number of 
+    // elements is not written to temporary files: it keeps at most twice the limit, with their values in 
+    // limit_alloc, which is replaced whenever the array is cut down (see truncate()).
+    bool spilling = q->ordered && ctx.opt_sort_memory>0 && !q->limit;
+    if (spilling && !run_alloc && array.size()>=1024) {
+        run_alloc = make_shared<MemoryPoolAllocator<> >();
+    }
+    MemoryPoolAllocator<>* data_alloc = ctx.data_alloc;
+    if (run_alloc) {
+        ctx.data_alloc = run_alloc.get();
+    } else if (limit_alloc) {
+        ctx.data_alloc = limit_alloc.get();
+    }
     for (TemplateQueryP& val: q->vals) {
         TQDataP new_data = val->makeData();
-        if (new_data->processData(ctx)) {
-            array.push_back(new_data);
+        MemoryPoolAllocator<>* array_alloc = ctx.data_alloc;
+        bool candidate = distinct!=nullptr;
+        if (candidate) {
+            if (!candidate_alloc) {
+                // Small chunks, since there may be many small arrays (e.g. one per group)
+                candidate_alloc.reset(new MemoryPoolAllocator<>(1024));
+            }
+            ctx.data_alloc = candidate_alloc.get();
+        }
+        bool processed = new_data->processData(ctx);
+        ctx.data_alloc = array_alloc;
+        if (processed) {
+            if (addElement(new_data) && candidate) {
+                new_data->relocate(ctx.dataAllocator());
+            }
             res = true;
         }
+        if (candidate) {
+            candidate_alloc->Clear();
+        }
+    }
+    ctx.data_alloc = data_alloc;
+    // With a limit, only the best elements are kept. Sorting whenever the array doubles is an amortized 
+    // O(log limit) per element.
+    if (q->limit && array.size()>=2*q->limit) {
+        truncate();
+    }
+    // The memory of the data objects themselves is estimated
+    const size_t element_overhead = 256;
+    if (spilling && (run_alloc?run_alloc->Size():0)+array.size()*element_overhead>ctx.opt_sort_memory) {
+        spill(ctx);
     }
     return res;
 }
 
-JSONValue TQArrayData::getJSON(TQContext& ctx)
+void TQArrayData::merge(const TQDataP& other, TQContext& ctx)
 {
-    bool ordered = false;
-    for (auto& val: q->vals) {
-        if (val->isOrdered()) {
-            ordered = true;
+    TQArrayData* o = static_cast<TQArrayData*>(other.get());
+    mergeState(o, ctx);
+    if (o->run_alloc || !o->runs.empty()) {
+        // The elements of o may refer to its allocator, so they are written to a temporary file as well
+        if (!o->array.empty()) {
+            o->spill(ctx);
+        }
+        runs.insert(runs.end(), o->runs.begin(), o->runs.end());
+        if (runs.size()>=max_runs) {
+            compactRuns();
+        }
+        return;
+    }
+    for (const TQDataP& d: o->array) {
+        addElement(d);
+    }
+    // The values of the elements of o may be in its allocator, which is released with it
+    if (q->limit && (o->limit_alloc || array.size()>=2*q->limit)) {
+        truncate();
+    }
+}
+
+void TQArrayData::relocate(MemoryPoolAllocator<>& alloc)
+{
+    TQData::relocate(alloc);
+    // Copied even when the array has an allocator of its own, since its first elements were added before it
+    for (TQDataP& d: array) {
+        d->relocate(alloc);
+    }
+}
+
+void TQArrayData::truncate()
+{
+    sortElements();
+    auto alloc = make_unique<MemoryPoolAllocator<> >();
+    for (TQDataP& d: array) {
+        d->relocate(*alloc);
+    }
+    limit_alloc = std::move(alloc);
+}
+
+bool TQArrayData::addElement(const TQDataP& d)
+{
+    // With a limit, the array is kept small by sorting it, which removes the duplicates as well
+    if (q->ordered && !q->limit) {
+        SortKeys keys;
+        d->getSortKeys(keys);
+        bool unique = !keys.empty();
+        size_t hash = std::hash<const void*>()(d->getTQ());
+        for (const SortKey& k: keys) {
+            unique = unique && (k.type==OrderType::UAscend || k.type==OrderType::UDescend);
+            hash ^= JSONHash()(k.value) + 0x9e3779b9 + (hash<<6) + (hash>>2);
+        }
+        if (unique) {
+            if (!distinct) {
+                distinct.reset(new unordered_set<DistinctElement, DistinctHash, DistinctEqual>());
+            }
+            if (!distinct->insert({hash, d}).second) {
+                return false;
+            }
+        }
+    }
+    array.push_back(d);
+    return true;
+}
+
+void TQArrayData::spill(TQContext& ctx)
+{
+    sortElements();
+    FILE* fp = createRun();
+    runs.emplace_back(fp, fclose);
+    char buffer[65536];
+    FileWriteStream os(fp, buffer, sizeof(buffer));
+    Writer<FileWriteStream> writer(os);
+    JSONWriterOutput<Writer<FileWriteStream> > out(writer);
+    // The elements are written as they would be in the result
+    bool in_get_JSON = ctx.in_get_JSON;
+    ctx.in_get_JSON = true;
+    SortKeys keys;
+    for (TQDataP& d: array) {
+        // An element is written in a line, as [[[number, type, value] for each sort key], value], 
+        // where the value is omitted if it's null.
+        writer.Reset(os);
+        writer.StartArray();
+        writer.StartArray();
+        keys.clear();
+        d->getSortKeys(keys);
+        for (const SortKey& k: keys) {
+            writer.StartArray();
+            writer.Int(k.num);
+            writer.Int(static_cast<int>(k.type));
+            k.value->Accept(writer);
+            writer.EndArray();
+        }
+        writer.EndArray();
+        d->writeJSON(ctx, out, nullptr);
+        writer.EndArray();
+        os.Put('\n');
+    }
+    ctx.in_get_JSON = in_get_JSON;
+    os.Flush();
+    array.clear();
+    // Duplicates of the spilled elements are removed when the runs are merged
+    distinct.reset();
+    if (run_alloc) {
+        run_alloc->Clear();
+    }
+    if (runs.size()>=max_runs) {
+        compactRuns();
+    }
+}
+
+void TQArrayData::compactRuns()
+{
+    FILE* fp = createRun();
+    shared_ptr<FILE> run(fp, fclose);
+    char buffer[65536];
+    FileWriteStream os(fp, buffer, sizeof(buffer));
+    Writer<FileWriteStream> writer(os);
+    mergeRuns([&](const JSONValue& record) {
+        writer.Reset(os);
+        record.Accept(writer);
+        os.Put('\n');
+    });
+    os.Flush();
+    runs.clear();
+    runs.push_back(run);
+}
+
+void TQArrayData::mergeSpilled(TQContext& ctx, const function<void(const JSONValue&)>& f)
+{
+    if (!array.empty()) {
+        spill(ctx);
+    }
+    mergeRuns([&](const JSONValue& record) {
+        if (record.Size()>1) {
+            f(record[1]);
+        }
+    });
+}
+
+void TQArrayData::mergeRuns(const function<void(const JSONValue&)>& f)
+{
+    // The current element of each run
+    struct Run {
+        FILE* fp;
+        char buffer[65536];
+        unique_ptr<FileReadStream> is;
+        Document doc;
+        SortKeys keys;
+
+        bool next() {
+            doc.SetNull();
+            doc.GetAllocator().Clear();
+            doc.ParseStream<kParseStopWhenDoneFlag>(*is);
+            if (doc.HasParseError()) {
+                if (doc.GetParseError()!=kParseErrorDocumentEmpty) {
+                    throw QueryError("Error reading a temporary file for sorting");
+                }
+                return false;
+            }
+            keys.clear();
+            for (const JSONValue& k: doc[0].GetArray()) {
+                keys.push_back({k[0].GetInt(), static_cast<OrderType>(k[1].GetInt()), &k[2]});
+            }
+            return true;
+        }
+    };
+    vector<unique_ptr<Run> > current;
+    for (auto& fp: runs) {
+        rewind(fp.get());
+        current.emplace_back(new Run);
+        Run& run = *current.back();
+        run.fp = fp.get();
+        run.is.reset(new FileReadStream(run.fp, run.buffer, sizeof(run.buffer)));
+    }
+    // The run with the first element in sorted order is at the top (or the first run, for equal elements)
+    auto later = [&](size_t a, size_t b) {
+        const SortKeys& ka = current[a]->keys;
+        const SortKeys& kb = current[b]->keys;
+        return compare_sort_keys(kb, ka) || (!compare_sort_keys(ka, kb) && a>b);
+    };
+    priority_queue<size_t, vector<size_t>, decltype(later)> heap(later);
+    for (size_t i=0; i<current.size(); ++i) {
+        if (current[i]->next()) {
+            heap.push(i);
+        }
+    }
+    // The sort keys of the previous element, for removing duplicates
+    Document prev;
+    SortKeys prev_keys;
+    size_t n = 0;
+    while (!heap.empty() && (!q->limit || n<q->limit)) {
+        size_t i = heap.top();
+        heap.pop();
+        Run& run = *current[i];
+        if (n==0 || !equal_sort_keys(prev_keys, run.keys)) {
+            f(run.doc);
+            n++;
+            prev.SetNull();
+            prev.GetAllocator().Clear();
+            prev.CopyFrom(run.doc[0], prev.GetAllocator());
+            prev_keys.clear();
+            for (const JSONValue& k: prev.GetArray()) {
+                prev_keys.push_back({k[0].GetInt(), static_cast<OrderType>(k[1].GetInt()), &k[2]});
+            }
+        }
+        if (run.next()) {
+            heap.push(i);
+        }
+    }
+}
+
+// How the values of a sort key are encoded, which depends on the values of that key in all the elements
+struct KeyEncoding {
+    bool has_int = false;
+    bool has_double = false;
+    bool has_string = false;
+    // Values that less_value() doesn't order by value, or not the same way when they are mixed with other 
+    // values (e.g. integers beyond the precision of a double, mixed with doubles)
+    bool has_other = false;
+    bool has_big_int = false;
+
+    void add(const JSONValue& v) {
+        if (v.IsInt64()) {
+            has_int = true;
+            int64_t i = v.GetInt64();
+            has_big_int = has_big_int || i>(int64_t(1)<<53) || i<-(int64_t(1)<<53);
+        } else if (v.IsDouble()) {
+            has_double = true;
+            has_other = has_other || std::isnan(v.GetDouble());
+        } else if (v.IsString()) {
+            has_string = true;
+            // strcmp() stops at a '\0'
+            has_other = has_other || strlen(v.GetString())!=v.GetStringLength();
+        } else {
+            has_other = true;
+        }
+    }
+    // Whether the order of the encoded values is the order of less_value()
+    bool isValid() const {
+        return !has_other && !(has_string && (has_int || has_double)) && !(has_double && has_big_int);
+    }
+};
+
+static void appendUint64(string& buf, uint64_t u)
+{
+    for (int shift=56; shift>=0; shift-=8) {
+        buf.push_back(static_cast<char>(u>>shift));
+    }
+}
+
+// Appends the value, so that encoded values compare as unsigned bytes in the order of less_value(). 
+// A value is never a prefix of another value with the same encoding, so the keys can be concatenated.
+static void encodeSortKey(string& buf, const JSONValue& v, const KeyEncoding& enc, OrderType type)
+{
+    size_t start = buf.size();
+    if (enc.has_string) {
+        buf.append(v.GetString(), v.GetStringLength());
+        buf.push_back('\0');
+    } else if (enc.has_double) {
+        double d = v.GetDouble();
+        if (d==0) {
+            // -0.0 is equal to 0.0
+            d = 0;
+        }
+        uint64_t u;
+        memcpy(&u, &d, sizeof(u));
+        appendUint64(buf, (u>>63)?~u:(u|(uint64_t(1)<<63)));
+    } else {
+        appendUint64(buf, static_cast<uint64_t>(v.GetInt64())^(uint64_t(1)<<63));
+    }
+    if (type==OrderType::Descend || type==OrderType::UDescend) {
+        for (size_t i=start; i<buf.size(); i++) {
+            buf[i] = ~buf[i];
+        }
+    }
+}
+
+// The encoded sort keys of an element in a buffer
+struct KeyRef {
+    // The first 8 bytes of the keys, padded with zeros, as a big-endian number
+    uint64_t prefix;
+    size_t offset;
+    uint32_t length;
+    uint32_t index;
+};
+
+// Sorts by the prefix only, in linear time (a least significant digit radix sort)
+static void radixSortByPrefix(vector<KeyRef>& refs)
+{
+    vector<KeyRef> tmp(refs.size());
+    for (int shift=0; shift<64; shift+=8) {
+        size_t count[257] = {0};
+        for (const KeyRef& r: refs) {
+            count[((r.prefix>>shift)&0xff)+1]++;
+        }
+        // Skip the byte if it's the same in all the keys
+        if (std::find(count+1, count+257, refs.size())!=count+257) {
+            continue;
+        }
+        for (int i=0; i<256; i++) {
+            count[i+1] += count[i];
+        }
+        for (const KeyRef& r: refs) {
+            tmp[count[(r.prefix>>shift)&0xff]++] = r;
+        }
+        refs.swap(tmp);
+    }
+}
+
+bool TQArrayData::sortByKeys()
+{
+    if (array.size()<2 || array.size()>UINT32_MAX) {
+        return false;
+    }
+    // The elements are sorted by the same keys if they are made from the same query, and have the same
+    // sort keys, in the same order, which compare_data() compares one after the other. Otherwise, the order
+    // of compare_data() is not necessarily consistent.
+    TemplateQuery* tq = array[0]->getTQ();
+    SortKeys first;
+    array[0]->getSortKeys(first);
+    if (first.empty()) {
+        return false;
+    }
+    size_t n_keys = first.size();
+    vector<KeyEncoding> encodings(n_keys);
+    SortKeys keys;
+    for (TQDataP& d: array) {
+        keys.clear();
+        d->getSortKeys(keys);
+        if (d->getTQ()!=tq || keys.size()!=n_keys) {
+            return false;
+        }
+        for (size_t i=0; i<n_keys; i++) {
+            if (keys[i].num!=first[i].num || keys[i].type!=first[i].type) {
+                return false;
+            }
+            encodings[i].add(*keys[i].value);
+        }
+    }
+    for (KeyEncoding& enc: encodings) {
+        if (!enc.isValid()) {
+            return false;
+        }
+    }
+    // equal_data() is true for elements whose keys are all unique and equal
+    bool unique = true;
+    for (const SortKey& k: first) {
+        unique = unique && (k.type==OrderType::UAscend || k.type==OrderType::UDescend);
+    }
+
+    string buf;
+    vector<KeyRef> refs(array.size());
+    for (size_t i=0; i<array.size(); i++) {
+        size_t start = buf.size();
+        keys.clear();
+        array[i]->getSortKeys(keys);
+        for (size_t j=0; j<n_keys; j++) {
+            encodeSortKey(buf, *keys[j].value, encodings[j], keys[j].type);
+        }
+        refs[i].offset = start;
+        refs[i].length = static_cast<uint32_t>(buf.size()-start);
+        refs[i].index = static_cast<uint32_t>(i);
+    }
+    for (KeyRef& r: refs) {
+        r.prefix = 0;
+        for (size_t i=0; i<8; i++) {
+            r.prefix = (r.prefix<<8) | (i<r.length?static_cast<unsigned char>(buf[r.offset+i]):0);
+        }
+    }
+    // The bytes after the prefix. The keys of an element are never a prefix of the keys of another, 
+    // so keys that are only different in length are equal.
+    auto compare_rest = [&](const KeyRef& a, const KeyRef& b) {
+        size_t len = std::min(a.length, b.length);
+        return len>8 ? memcmp(buf.data()+a.offset+8, buf.data()+b.offset+8, len-8) : 0;
+    };
+    auto less = [&](const KeyRef& a, const KeyRef& b) {
+        return a.prefix<b.prefix || (a.prefix==b.prefix && compare_rest(a, b)<0);
+    };
+    if (refs.size()<4096) {
+        sort(refs.begin(), refs.end(), less);
+    } else {
+        radixSortByPrefix(refs);
+        // Sort the elements with the same prefix by the rest of the keys
+        for (auto it=refs.begin(); it!=refs.end(); ) {
+            auto end = std::find_if(it, refs.end(), [&](const KeyRef& r) {return r.prefix!=it->prefix;});
+            if (end-it>1) {
+                sort(it, end, less);
+            }
+            it = end;
+        }
+    }
+
+    vector<TQDataP> sorted;
+    sorted.reserve(array.size());
+    const KeyRef* prev = nullptr;
+    for (const KeyRef& r: refs) {
+        if (unique && prev && prev->prefix==r.prefix && compare_rest(*prev, r)==0) {
+            continue;
         }
+        sorted.push_back(std::move(array[r.index]));
+        prev = &r;
     }
+    array.swap(sorted);
+    return true;
+}
 
-    if (ordered) {
-        sort(array.begin(), array.end(), compare_data);
-        auto it = unique(array.begin(), array.end(), equal_data);
-        array.resize(std::distance(array.begin(), it));
+void TQArrayData::sortElements()
+{
+    if (q->ordered) {
+        // The sort keys are compared as strings of bytes, instead of calling compare_data(), which compares
+        // the values of the sort keys (with virtual calls and conversions) in every comparison.
+        if (!sortByKeys()) {
+            sort(array.begin(), array.end(), compare_data);
+            auto it = unique(array.begin(), array.end(), equal_data);
+            array.resize(std::distance(array.begin(), it));
+        }
+        if (q->limit && array.size()>q->limit) {
+            array.resize(q->limit);
+        }
     }
+}
+
+JSONValue TQArrayData::getJSON(TQContext& ctx)
+{
     JSONValue res(rapidjson::kArrayType);
+    if (!runs.empty()) {
+        mergeSpilled(ctx, [&](const JSONValue& v) {
+            res.PushBack(JSONValue(v, ctx.allocator()), ctx.allocator());
+        });
+        return res;
+    }
+    sortElements();
     for (TQDataP& v: array) {
         JSONValue j = v->getJSON(ctx);
         if (!j.IsNull()) {
-            res.PushBack(j, ctx.doc->GetAllocator());
+            res.PushBack(j, ctx.allocator());
         }
     }
 
     return res;
 }
 
+bool TQArrayData::writeJSON(TQContext& ctx, JSONOutput& out, const string* key)
+{
+    if (key) {
+        out.Key(*key);
+    }
+    out.StartArray();
+    SizeType n = 0;
+    if (!runs.empty()) {
+        mergeSpilled(ctx, [&](const JSONValue& v) {
+            v.Accept(out);
+            n++;
+        });
+    } else {
+        sortElements();
+        for (TQDataP& v: array) {
+            n += v->writeJSON(ctx, out, nullptr);
+        }
+    }
+    out.EndArray(n);
+    return true;
+}
+
 bool TQValueWithCond::isAggregate(TQContext* ctx) const
 {
     return cond->isAggregate(ctx)|| (val&& val->isAggregate(ctx));
 }
 
+void TQArray::collectFields(FieldUsage& used, bool at_root) const
+{
+    for (auto& v: vals) {
+        v->collectFields(used, at_root);
+    }
+}
+
 TQDataP TQValueWithCond::makeData()
 {
-    return TQDataP(new TQValueWithCondData(this));
+    return make_shared<TQValueWithCondData>(this);
 }
 
 TemplateQueryP TQValueWithCond::replace(const TemplateQueryP& v) 
@@ -1039,11 +2002,32 @@ JSONValue TQValueWithCondData::getJSON(TQContext& ctx)
     return innerData->getJSON(ctx);
 }
 
+bool TQValueWithCondData::writeJSON(TQContext& ctx, JSONOutput& out, const string* key)
+{
+    if (q->cond->isAggregate(&ctx)) {
+        ctx.pushData(this);
+        bool t = q->cond->test(ctx);
+        ctx.popData(this);
+        if (!t) {
+            return false;
+        }
+    }
+    return innerData && innerData->writeJSON(ctx, out, key);
+}
+
 bool TQValueWithCondData::isAggregate(TQContext* ctx) const 
 {
     return q->isAggregate(ctx);
 }
 
+void TQValueWithCond::collectFields(FieldUsage& used, bool at_root) const
+{
+    cond->collectFields(used, at_root);
+    if (val) {
+        val->collectFields(used, at_root);
+    }
+}
+
 TQDataP TQCondWrapper::makeData()
 {
     return this_p;
@@ -1059,13 +2043,36 @@ bool TQCondWrapper::processData(TQContext& ctx)
     return cond->test(ctx);
 }
 
+void TQCondWrapper::collectFields(FieldUsage& used, bool at_root) const
+{
+    cond->collectFields(used, at_root);
+}
+
 TQDataP TQObject::makeData()
 {
-    return TQDataP(new TQObjectData(this));
+    return make_shared<TQObjectData>(this);
+}
+
+void TQObject::collectFields(FieldUsage& used, bool at_root) const
+{
+    for (auto& m: fields) {
+        if (m.first->getKeyType()==KeyType::Func) {
+            // Function bodies are evaluated wherever the function is called
+            used.addAll();
+            return;
+        }
+        m.first->collectFields(used, at_root);
+        if (m.second) {
+            m.second->collectFields(used, at_root);
+        }
+    }
 }
 
 void TQObject::add(const TQKeyP& key, const TemplateQueryP& value, const TemplateQueryP& cond)
 {
+    const TQValue* v = dynamic_cast<const TQValue*>(value.get());
+    bool aggregate = !cond && dynamic_cast<const TQSimpleKey*>(key.get()) && v && v->isAggregateFunction() && !v->isOrdered();
+    aggregates_only = aggregate && (fields.empty() || aggregates_only);
     if (cond) {
         TQKeyP ck = TQKeyP(new TQDirectiveKey(KeyType::Cond));
         fields.emplace_back(ck, cond);
@@ -1079,46 +2086,109 @@ void TQObject::add(const TQKeyP& key, const TemplateQueryP& value, const Templat
         fields.emplace_back(key, value);
         if (value->isOrdered()) {
             ordered = true;
+            limit = minLimit(limit, value->getLimit());
         }
     }
 }
 
-TQDataP TQObjectData::getFieldData(const string& key, TemplateQueryP& tq, bool sorted)
+TQDataP* FieldTable::find(const string& key)
 {
-    if (sorted) {
-        auto it = sorted_fields.find(key);
-        if (it==sorted_fields.end()) {
-            return tq->makeData();
-        }
-        return it->second;
+    if (slots.empty()) {
+        return nullptr;
     }
-    // unsorted
-    auto it = unsorted_fields_map.find(key);
-    if (it==unsorted_fields_map.end()) {
-        return tq->makeData();
+    int i = slots[findSlot(key, std::hash<string>()(key))];
+    return (i<0)?nullptr:&fields[i].second;
+}
+
+void FieldTable::set(const string& key, const TQDataP& data)
+{
+    if ((fields.size()+1)*2>slots.size()) {
+        rebuildIndex(max<size_t>(16, slots.size()*2));
+    }
+    size_t hash = std::hash<string>()(key);
+    size_t slot = findSlot(key, hash);
+    if (slots[slot]>=0) {
+        fields[slots[slot]].second = data;
+        return;
     }
-    return unsorted_fields[it->second].second;
+    is_sorted = is_sorted && (fields.empty() || fields.back().first<key);
+    slots[slot] = fields.size();
+    fields.emplace_back(key, data);
+    hashes.push_back(hash);
 }
 
-void TQObjectData::storeData(const string& key, TQDataP& data, bool sorted)
+void FieldTable::sort()
 {
-    if (sorted) {
-        sorted_fields[key] = data;
-    } else {
-        auto it = unsorted_fields_map.find(key);
-        if (it==unsorted_fields_map.end()) {
-            unsorted_fields_map[key] = unsorted_fields.size();
-            unsorted_fields.push_back(make_pair(key, data));
-        } else {
-            unsorted_fields[it->second].second = data;
+    if (is_sorted) {
+        return;
+    }
+    vector<int> order(fields.size());
+    for (int i=0; i<order.size(); ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](int a, int b) {return fields[a].first<fields[b].first;});
+    vector<Field> by_key;
+    vector<size_t> by_key_hashes;
+    by_key.reserve(fields.size());
+    by_key_hashes.reserve(fields.size());
+    for (int i: order) {
+        by_key.push_back(std::move(fields[i]));
+        by_key_hashes.push_back(hashes[i]);
+    }
+    fields.swap(by_key);
+    hashes.swap(by_key_hashes);
+    rebuildIndex(slots.size());
+    is_sorted = true;
+}
+
+size_t FieldTable::findSlot(const string& key, size_t hash) const
+{
+    size_t mask = slots.size()-1;
+    size_t slot = hash&mask;
+    while (slots[slot]>=0) {
+        int i = slots[slot];
+        if (hashes[i]==hash && fields[i].first==key) {
+            break;
         }
+        slot = (slot+1)&mask;
     }
+    return slot;
+}
+
+void FieldTable::rebuildIndex(size_t capacity)
+{
+    slots.assign(capacity, -1);
+    size_t mask = capacity-1;
+    for (int i=0; i<fields.size(); ++i) {
+        size_t slot = hashes[i]&mask;
+        while (slots[slot]>=0) {
+            slot = (slot+1)&mask;
+        }
+        slots[slot] = i;
+    }
+}
+
+TQDataP TQObjectData::getFieldData(const string& key, TemplateQueryP& tq, bool sorted)
+{
+    TQDataP* data = (sorted?sorted_fields:unsorted_fields).find(key);
+    if (!data) {
+        return tq->makeData();
+    }
+    return *data;
+}
+
+void TQObjectData::storeData(const string& key, TQDataP& data, bool sorted)
+{
+    (sorted?sorted_fields:unsorted_fields).set(key, data);
 }
 
 
 
 bool TQObjectData::processData(TQContext& ctx)
 {
+    if (q->aggregates_only) {
+        return processAggregates(ctx);
+    }
     // Test all conditions
     ctx.pushData(this);
     for (auto& m: q->fields) {
@@ -1141,19 +2211,29 @@ bool TQObjectData::processData(TQContext& ctx)
             continue;
         } else if (kt==KeyType::Variable) {
             const string& name = m.first->getName();
+            // The value of a plain expression is used as is, instead of copying it twice for every input.
+            // It remains valid while the variable is in scope.
+            const TQValue* v = dynamic_cast<const TQValue*>(m.second.get());
+            if (v && !v->isOrdered() && !v->isAggregate(&ctx)) {
+                ctx.addVar(name, v->expression()->asJSON(ctx));
+                continue;
+            }
             TQDataP d= m.second->makeData();
             if (d) {
                 d->processData(ctx);
             }
-            JSONValueP j = JSONValueP(new JSONValue(d->getJSON(ctx)));
+            JSONValueP j = make_shared<JSONValue>(d->getJSON(ctx));
             ctx.addVar(name, j);
             continue;
         } else if (kt==KeyType::Assign) {
             const string& name = m.first->getName();
             TQDataP d= m.second->makeData();
             d->processData(ctx);
-            JSONValueP j = JSONValueP(new JSONValue(d->getJSON(ctx)));
-            ctx.assignVar(name, j);
+            // The variable may outlive the current document, so it is copied to a document of its own, instead of 
+            // the scratch allocator or the context's document (which -per-doc clears after each input value)
+            auto var_doc = make_shared<Document>();
+            var_doc->CopyFrom(d->getJSON(ctx), var_doc->GetAllocator(), true);
+            ctx.assignVar(name, var_doc);
             continue;
         } else if (kt==KeyType::Return) {
             if (!returned) {
@@ -1198,7 +2278,7 @@ JSONValue TQObjectData::getJSON(TQContext& ctx)
     if (returned) {
         return returned->getJSON(ctx);
     }
-    auto& alloc = ctx.doc->GetAllocator();
+    auto& alloc = ctx.allocator();
 
     for (auto& c: q->conditions_data) {
         if (c->isAggregate(&ctx)) {
@@ -1222,8 +2302,8 @@ JSONValue TQObjectData::getJSON(TQContext& ctx)
         }
     }
 
+    sorted_fields.sort();
     for (auto& m: sorted_fields) {
-        
         JSONValue key_val(m.first.c_str(), alloc);
         JSONValue val = m.second->getJSON(ctx);
         if (!val.IsNull() || ctx.opt_show_null) {
@@ -1233,6 +2313,124 @@ JSONValue TQObjectData::getJSON(TQContext& ctx)
     return res;
 }
 
+bool TQObjectData::writeJSON(TQContext& ctx, JSONOutput& out, const string* key)
+{
+    if (returned) {
+        return returned->writeJSON(ctx, out, key);
+    }
+    for (auto& c: q->conditions_data) {
+        if (c->isAggregate(&ctx)) {
+           ctx.pushData(this);
+           bool t = c->processData(ctx);
+           ctx.popData(this);
+           if (!t) {
+              return false;
+           }
+        }
+    }
+
+    if (key) {
+        out.Key(*key);
+    }
+    out.StartObject();
+    SizeType n = 0;
+    auto writeField = [&](const string& k, const TQDataP& data) {
+        if (data->writeJSON(ctx, out, &k)) {
+            n++;
+        } else if (ctx.opt_show_null) {
+            out.Key(k);
+            out.Null();
+            n++;
+        }
+    };
+    for (auto& m: unsorted_fields) {
+        writeField(m.first, m.second);
+    }
+    sorted_fields.sort();
+    for (auto& m: sorted_fields) {
+        writeField(m.first, m.second);
+    }
+    out.EndObject(n);
+    return true;
+}
+
+// An object with only aggregate functions (e.g. {"total":"$sum(amount)", "n":"$count"}) is evaluated
+// for every element of the context, so skip the key lookups and just update each of the fields.
+bool TQObjectData::processAggregates(TQContext& ctx)
+{
+    if (aggregate_fields.empty()) {
+        for (auto& m: q->fields) {
+            const string& k = static_cast<TQSimpleKey*>(m.first.get())->getKey();
+            bool stored = unsorted_fields.find(k)!=nullptr;
+            aggregate_fields.emplace_back(getFieldData(k, m.second, false), stored);
+        }
+    }
+    ctx.pushData(this);
+    for (size_t i=0; i<aggregate_fields.size(); i++) {
+        const string& k = static_cast<TQSimpleKey*>(q->fields[i].first.get())->getKey();
+        auto& field = aggregate_fields[i];
+        ctx.pushReskey(k);
+        if (field.first->processData(ctx) && !field.second) {
+            storeData(k, field.first, false);
+            field.second = true;
+        }
+        ctx.popReskey();
+    }
+    ctx.popData(this);
+    return !isEmpty();
+}
+
+void TQObjectData::merge(const TQDataP& other, TQContext& ctx)
+{
+    TQObjectData* o = static_cast<TQObjectData*>(other.get());
+    mergeState(o, ctx);
+    // Fields may be replaced by the merge
+    aggregate_fields.clear();
+    if (o->returned) {
+        if (returned) {
+            returned->merge(o->returned, ctx);
+        } else {
+            returned = o->returned;
+        }
+    }
+    for (auto& m: o->unsorted_fields) {
+        TQDataP* data = unsorted_fields.find(m.first);
+        if (!data) {
+            unsorted_fields.set(m.first, m.second);
+        } else {
+            (*data)->merge(m.second, ctx);
+        }
+    }
+    for (auto& m: o->sorted_fields) {
+        TQDataP* data = sorted_fields.find(m.first);
+        if (!data) {
+            sorted_fields.set(m.first, m.second);
+        } else {
+            (*data)->merge(m.second, ctx);
+        }
+    }
+    // Ordering refers to the field data, so only entries that are new to this object are added
+    for (auto& m: o->ordering) {
+        ordering.insert(m);
+    }
+}
+
+void TQObjectData::relocate(MemoryPoolAllocator<>& alloc)
+{
+    TQData::relocate(alloc);
+    if (returned) {
+        returned->relocate(alloc);
+    }
+    for (auto& m: unsorted_fields) {
+        m.second->relocate(alloc);
+    }
+    for (auto& m: sorted_fields) {
+        m.second->relocate(alloc);
+    }
+    // The ordering data that isn't a field (without a value) has nothing to copy, and aggregate_fields are 
+    // fields as well
+}
+
 bool TQObjectData::compare(const TQDataP& other) const
 {
     const TQObjectData* o = dynamic_cast<TQObjectData*>(other.get());
@@ -1260,6 +2458,13 @@ bool TQObjectData::compare(const TQDataP& other) const
     return false;
 }
 
+void TQObjectData::getSortKeys(SortKeys& keys) const
+{
+    for (auto& m: ordering) {
+        m.second->getSortKeys(keys);
+    }
+}
+
 bool TQObjectData::equal(const TQDataP& other) const
 {
     const TQObjectData* o = dynamic_cast<TQObjectData*>(other.get());
@@ -1284,9 +2489,15 @@ bool TQObjectData::equal(const TQDataP& other) const
 
 
 
+TQValue::TQValue(const TExpressionP& e, OrderType ot, int on, size_t ol)
+    : exp(e), ord_type(ot), ord_num(on), ord_limit(ol)
+{
+    aggregate_func = dynamic_cast<TExprAggregate*>(e.get())!=nullptr;
+}
+
 TQDataP TQValue::makeData()
 {
-    return TQDataP(new TQValueData(this));
+    return make_shared<TQValueData>(this);
 }
 
 bool TQValueData::processData(TQContext& ctx)
@@ -1296,9 +2507,27 @@ bool TQValueData::processData(TQContext& ctx)
         return false;
     }
     ctx.pushData(this);
+    if (q->aggregate_func && val && val.use_count()==1) {
+        // Same as asJSON(), but update the number in place instead of allocating a new value for each input
+        TExpression* exp = q->exp.get();
+        if (exp->isDouble(&ctx)) {
+            val->SetDouble(exp->getDouble(ctx));
+        } else {
+            val->SetInt64(exp->getInt(ctx));
+        }
+        ctx.popData(this);
+        updated = true;
+        return true;
+    }
     JSONValueP v = q->exp->asJSON(ctx);
     // Create a copy of the JSONValue, ensuring it wont get lost when the source json is gone
-    val = JSONValueP(new JSONValue(*v, ctx.doc->GetAllocator()));
+    // (including strings that refer to the source buffer, when parsed in situ).
+    // Aggregates are re-evaluated for each input, so reuse the previous value when it isn't shared.
+    if (val && val.use_count()==1) {
+        val->CopyFrom(*v, ctx.dataAllocator(), true);
+    } else {
+        val = make_shared<JSONValue>(*v, ctx.dataAllocator(), true);
+    }
     //val = q->exp->asJSON(ctx);
     ctx.popData(this);
     if (val->IsNull()) {
@@ -1314,10 +2543,49 @@ JSONValue TQValueData::getJSON(TQContext& ctx)
         return {};
     }
     // It's a bit faster to do a move, but destroys the value in this object
-    return JSONValue(*val, ctx.doc->GetAllocator());
+    return JSONValue(*val, ctx.allocator());
 //    return std::move(val);
 }
 
+bool TQValueData::writeJSON(TQContext& ctx, JSONOutput& out, const string* key)
+{
+    if (!val || val->IsNull()) {
+        return false;
+    }
+    if (key) {
+        out.Key(*key);
+    }
+    return val->Accept(out);
+}
+
+void TQValueData::merge(const TQDataP& other, TQContext& ctx)
+{
+    TQValueData* o = static_cast<TQValueData*>(other.get());
+    mergeState(o, ctx);
+    if (q->exp->isAggregate(&ctx)) {
+        // Re-evaluate the value from the merged state of the aggregate functions (ctx.in_get_JSON is set)
+        ctx.pushData(this);
+        JSONValueP v = q->exp->asJSON(ctx);
+        val = make_shared<JSONValue>(*v, ctx.dataAllocator(), true);
+        ctx.popData(this);
+        updated = updated || o->updated;
+    } else if (!updated && o->val) {
+        // Not an aggregate, so the first value is the one that is kept
+        val = o->val;
+        updated = o->updated;
+    }
+}
+
+void TQValueData::relocate(MemoryPoolAllocator<>& alloc)
+{
+    TQData::relocate(alloc);
+    if (val && !val->IsNull()) {
+        // Replaced in place, since the value may be shared by a merged data object
+        JSONValue copy(*val, alloc, true);
+        val->Swap(copy);
+    }
+}
+
 bool TQValueData::compare(const TQDataP& other) const
 {
     if (q->ord_type == OrderType::None) {
@@ -1327,27 +2595,89 @@ bool TQValueData::compare(const TQDataP& other) const
     if (!o) {
         return false;
     }
-    const TQValueData* x;
-    const TQValueData* y;
     if (q->ord_type==OrderType::Ascend||q->ord_type==OrderType::UAscend) {
-        x = this;
-        y = o;
-    } else {
-        x = o;
-        y = this;
-    }
-    if (x->val->IsInt64() && y->val->IsInt64()) {
-        return x->val->GetInt64() < y->val->GetInt64();
-    } else if (x->val->IsString() && y->val->IsString()) {
-        return strcmp(x->val->GetString(), y->val->GetString())<0;
-    } else if (x->val->IsString() || y->val->IsString()) {
-        string sx = valToString(x->val);
-        string sy = valToString(y->val);
+        return less_value(*val, *o->val);
+    }
+    return less_value(*o->val, *val);
+}
+
+void TQValueData::getSortKeys(SortKeys& keys) const
+{
+    if (q->isOrdered() && val) {
+        keys.push_back({q->getOrderNumber(), q->getOrderType(), val.get()});
+    }
+}
+
+bool less_value(const JSONValue& x, const JSONValue& y)
+{
+    if (x.IsInt64() && y.IsInt64()) {
+        return x.GetInt64() < y.GetInt64();
+    } else if (x.IsString() && y.IsString()) {
+        return strcmp(x.GetString(), y.GetString())<0;
+    } else if (x.IsString() || y.IsString()) {
+        string sx = valToString(&x);
+        string sy = valToString(&y);
         return sx<sy;
-    } else if (x->val->IsDouble() || y->val->IsDouble()) {
-        return valToDouble(x->val)<valToDouble(y->val);
+    } else if (x.IsDouble() || y.IsDouble()) {
+        return valToDouble(&x)<valToDouble(&y);
+    }
+    return &x<&y;
+}
+
+static const SortKey* find_sort_key(const SortKeys& keys, int num)
+{
+    for (const SortKey& k: keys) {
+        if (k.num==num) {
+            return &k;
+        }
+    }
+    return nullptr;
+}
+
+static bool less_sort_key(const SortKey& x, const SortKey& y)
+{
+    if (x.type==OrderType::Ascend||x.type==OrderType::UAscend) {
+        return less_value(*x.value, *y.value);
+    }
+    return x.type!=OrderType::None && less_value(*y.value, *x.value);
+}
+
+// Same as TQObjectData::compare(), which for a single key is the same as TQValueData::compare()
+bool compare_sort_keys(const SortKeys& a, const SortKeys& b)
+{
+    for (const SortKey& k: b) {
+        if (!find_sort_key(a, k.num)) {
+            return true;
+        }
+    }
+    for (const SortKey& k: a) {
+        const SortKey* o = find_sort_key(b, k.num);
+        if (!o) {
+            return false;
+        }
+        if (less_sort_key(k, *o)) {
+            return true;
+        }
+        if (less_sort_key(*o, k)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Same as TQObjectData::equal() and TQValueData::equal()
+bool equal_sort_keys(const SortKeys& a, const SortKeys& b)
+{
+    if (a.empty() && !b.empty()) {
+        return false;
+    }
+    for (const SortKey& k: a) {
+        const SortKey* o = find_sort_key(b, k.num);
+        if (!o || (k.type!=OrderType::UAscend && k.type!=OrderType::UDescend) || *k.value!=*o->value) {
+            return false;
+        }
     }
-    return x<y;
+    return true;
 }
 
 bool TQValueData::equal(const TQDataP& other) const
@@ -1362,6 +2692,14 @@ bool TQValueData::equal(const TQDataP& other) const
     return *val==*(o->val);
 }
 
+void TQCondBool::collectFields(FieldUsage& used, bool at_root) const
+{
+    cond1->collectFields(used, at_root);
+    if (cond2) {
+        cond2->collectFields(used, at_root);
+    }
+}
+
 bool TQCondBool::test(TQContext& ctx)
 {
     bool r1 = cond1->test(ctx);
@@ -1379,10 +2717,20 @@ bool TQCondBool::test(TQContext& ctx)
 }
 
 
+TQStringTest::TQStringTest(const TExpressionP& x1, const TExpressionP& y1, Operator o)
+    : x(x1), y(y1), op(o)
+{
+    const TExprStringConst* pattern = dynamic_cast<const TExprStringConst*>(y.get());
+    if (op==Operator::MATCH && pattern) {
+        re = compileRegex(pattern->value());
+        const_regex = true;
+    }
+}
+
 bool TQStringTest::test(TQContext& ctx)
 {
     string v1 = x->getString(ctx);
-    string v2 = y->getString(ctx);
+    string v2 = const_regex?string():y->getString(ctx);
     switch (op) {
         case Operator::EQ:
             return v1==v2;
@@ -1394,10 +2742,8 @@ bool TQStringTest::test(TQContext& ctx)
             return v1.rfind(v2,0)==0;
         case Operator::ENDS:
             return v1.compare(v1.size()-v2.size(), v2.size(), v2)==0;
-        case Operator::MATCH: {
-            regex re(v2);
-            return regex_match(v1, re);
-        }
+        case Operator::MATCH:
+            return regex_match(v1, const_regex?re:ctx.getRegex(v2));
         default:
             return false;
     }
@@ -1433,27 +2779,14 @@ bool TQJSONTest::test(TQContext& ctx)
         case Operator::NEQ:
             return *v1!=*v2;
         case Operator::IN:
-            return in_operator(v1, v2);
+            return ctx.inArray(this, v2, *v1);
         case Operator::NOTIN:
-            return !in_operator(v1, v2);
+            return !ctx.inArray(this, v2, *v1);
         default:
             return false;
     }
 }
 
-bool TQJSONTest::in_operator(const JSONValueP& v1, const JSONValueP& v2)
-{
-    if (!v2->IsArray()) {
-        return false;
-    }
-    for (auto& k: v2->GetArray()) {
-        if (k==*v1) {
-            return true;
-        }
-    }
-    return false;
-}
-
 
 bool TQExistsTest::test(TQContext& ctx)
 {
@@ -1493,23 +2826,34 @@ JSONValueP TExpression::asJSON(TQContext& ctx)
     }
     if (isString(&ctx)) {
         string s = getString(ctx);
-        return JSONValueP(new JSONValue(s.c_str(), s.size(), ctx.doc->GetAllocator()));
+        return make_shared<JSONValue>(s.c_str(), s.size(), ctx.scratch);
     } else if (isDouble(&ctx)) {
         double d = getDouble(ctx);
-        return JSONValueP(new JSONValue(d));
+        return make_shared<JSONValue>(d);
     } else if (isInt(&ctx)) {
         int64_t i = getInt(ctx);
-        return JSONValueP(new JSONValue(i));
+        return make_shared<JSONValue>(i);
     } else if (isBool(&ctx)) {
         bool b = getBool(ctx);
-        return JSONValueP(new JSONValue(b));
+        return make_shared<JSONValue>(b);
     }
-    return JSONValueP(new JSONValue);
+    return nullJSON();
+}
+
+void TExprField::collectFields(FieldUsage& used, bool at_root) const
+{
+    if (expr) {
+        // A computed path can be anywhere
+        used.addAll();
+        return;
+    }
+    readPath(path.steps(), used, at_root);
 }
 
 bool TExprField::isString(TQContext* ctx)
 {
     if (!ctx) return true;
+    if (!expr) return ctx->isString(path);
     string field = getFieldName(ctx);
     return ctx->isString(field);
 }
@@ -1517,6 +2861,7 @@ bool TExprField::isString(TQContext* ctx)
 bool TExprField::isDouble(TQContext* ctx)
 {
     if (!ctx) return true;
+    if (!expr) return ctx->isDouble(path);
     string field = getFieldName(ctx);
     return ctx->isDouble(field);
 
@@ -1525,6 +2870,7 @@ bool TExprField::isDouble(TQContext* ctx)
 bool TExprField::isInt(TQContext* ctx)
 {
     if (!ctx) return true;
+    if (!expr) return ctx->isInt(path);
     string field = getFieldName(ctx);
     return ctx->isInt(field);
 }
@@ -1532,6 +2878,7 @@ bool TExprField::isInt(TQContext* ctx)
 bool TExprField::isBool(TQContext* ctx)
 {
     if (!ctx) return true;
+    if (!expr) return ctx->isBool(path);
     string field = getFieldName(ctx);
     return ctx->isBool(field);
 }
@@ -1539,6 +2886,7 @@ bool TExprField::isBool(TQContext* ctx)
 
 bool TExprField::exists(TQContext& ctx)
 {
+    if (!expr) return ctx.exists(path);
     string field = getFieldName(&ctx);
     return ctx.exists(field);
 }
@@ -1554,6 +2902,7 @@ string TExprField::getFieldName(TQContext* ctx)
 
 JSONValueP TExprField::getJSON(TQContext& ctx)
 {
+    if (!expr) return ctx.getJSON(path);
     string field = getFieldName(&ctx);
     //JSONValueP res = ctx.getJSON(field);
     //return JSONValueP(new JSONValue(*res, ctx.doc->GetAllocator()));
@@ -1562,28 +2911,47 @@ JSONValueP TExprField::getJSON(TQContext& ctx)
 
 string TExprField::getString(TQContext& ctx)
 {
+    if (!expr) return valToString(ctx.getJSON(path));
     string field = getFieldName(&ctx);
     return ctx.getString(field);
 }
 
 int64_t TExprField::getInt(TQContext& ctx)
 {
+    if (!expr) return valToInt(ctx.getJSON(path));
     string field = getFieldName(&ctx);
     return ctx.getInt(field);
 }
 
 double TExprField::getDouble(TQContext& ctx)
 {
+    if (!expr) return valToDouble(ctx.getJSON(path));
     string field = getFieldName(&ctx);
     return ctx.getDouble(field);
 }
 
 bool TExprField::getBool(TQContext& ctx)
 {
+    if (!expr) return valToBool(ctx.getJSON(path));
     string field = getFieldName(&ctx);
     return ctx.getBool(field);
 }
 
+TExprChangepath::TExprChangepath(const TExpressionP& e, Operator o): exp(e), op(o)
+{
+    const FieldPath* p = exp->getConstPath();
+    if (p && (op==Operator::ROOT || op==Operator::UP)) {
+        path = FieldPath(((op==Operator::ROOT)?"/":"../")+p->str());
+        const_path = true;
+    }
+}
+
+void TExprChangepath::collectFields(FieldUsage& used, bool at_root) const
+{
+    // The root, or an enclosing context that may be the root
+    exp->collectFields(used, true);
+}
+
 bool TExprChangepath::exists(TQContext& ctx)
 {
     adjustPath(ctx);
@@ -1594,6 +2962,9 @@ bool TExprChangepath::exists(TQContext& ctx)
 
 JSONValueP TExprChangepath::getJSON(TQContext& ctx)
 {
+    if (const_path) {
+        return ctx.getJSON(path);
+    }
     if (isField()) {
         return ctx.getJSON(getFieldPath(ctx));
     }
@@ -1606,6 +2977,9 @@ JSONValueP TExprChangepath::getJSON(TQContext& ctx)
 
 string TExprChangepath::getString(TQContext& ctx)
 {
+    if (const_path) {
+        return valToString(ctx.getJSON(path));
+    }
     if (isField()) {
         return ctx.getString(getFieldPath(ctx));
     }
@@ -1617,6 +2991,9 @@ string TExprChangepath::getString(TQContext& ctx)
 
 int64_t TExprChangepath::getInt(TQContext& ctx)
 {
+    if (const_path) {
+        return valToInt(ctx.getJSON(path));
+    }
     if (isField()) {
         return ctx.getInt(getFieldPath(ctx));
     }
@@ -1628,6 +3005,9 @@ int64_t TExprChangepath::getInt(TQContext& ctx)
 
 double TExprChangepath::getDouble(TQContext& ctx)
 {
+    if (const_path) {
+        return valToDouble(ctx.getJSON(path));
+    }
     if (isField()) {
         return ctx.getDouble(getFieldPath(ctx));
     }
@@ -1640,6 +3020,9 @@ double TExprChangepath::getDouble(TQContext& ctx)
 
 bool TExprChangepath::getBool(TQContext& ctx)
 {
+    if (const_path) {
+        return valToBool(ctx.getJSON(path));
+    }
     if (isField()) {
         return ctx.getBool(getFieldPath(ctx));
     }
@@ -1687,6 +3070,13 @@ void TExprChangepath::restorePath(TQContext& ctx)
     }
 }
 
+void TExprITE::collectFields(FieldUsage& used, bool at_root) const
+{
+    cond->collectFields(used, at_root);
+    th->collectFields(used, at_root);
+    el->collectFields(used, at_root);
+}
+
 JSONValueP TExprITE::getJSON(TQContext& ctx)
 {
     if (cond->test(ctx)) {
@@ -1907,6 +3297,12 @@ bool TExprBinaryOp::isDouble(TQContext* ctx)
     return (arg1->isDouble(ctx)||arg2->isDouble(ctx))&&!isString(ctx);
 }
 
+void TExprBinaryOp::collectFields(FieldUsage& used, bool at_root) const
+{
+    arg1->collectFields(used, at_root);
+    arg2->collectFields(used, at_root);
+}
+
 bool TExprBinaryOp::isInt(TQContext* ctx)
 {
     return arg1->isInt(ctx)&&arg2->isInt(ctx);
@@ -1971,6 +3367,15 @@ string TExprBinaryOp::getString(TQContext& ctx)
     return {};
 }
 
+void TExprSubstr::collectFields(FieldUsage& used, bool at_root) const
+{
+    str->collectFields(used, at_root);
+    start->collectFields(used, at_root);
+    if (length) {
+        length->collectFields(used, at_root);
+    }
+}
+
 string TExprSubstr::getString(TQContext& ctx)
 {
     string s = str->getString(ctx);
@@ -1986,10 +3391,16 @@ string TExprSubstr::getString(TQContext& ctx)
     }
 }
 
+void TExprFind::collectFields(FieldUsage& used, bool at_root) const
+{
+    str->collectFields(used, at_root);
+    searched->collectFields(used, at_root);
+}
+
 JSONValueP TExprFind::getJSON(TQContext& ctx)
 {
-    auto& alloc = ctx.doc->GetAllocator();
-    JSONValueP res(new JSONValue(rapidjson::kArrayType));
+    auto& alloc = ctx.scratch;
+    JSONValueP res = make_shared<JSONValue>(rapidjson::kArrayType);
     string s1 = str->getString(ctx);
     string s2 = searched->getString(ctx);
     if (!case_sensitive) {
@@ -2005,6 +3416,13 @@ JSONValueP TExprFind::getJSON(TQContext& ctx)
     return res;
 }
 
+void TExprReplace::collectFields(FieldUsage& used, bool at_root) const
+{
+    source->collectFields(used, at_root);
+    from->collectFields(used, at_root);
+    to->collectFields(used, at_root);
+}
+
 string TExprReplace::getString(TQContext& ctx)
 {
     string s = source->getString(ctx);
@@ -2029,6 +3447,55 @@ string TExprReplace::getString(TQContext& ctx)
 }
 
 
+TExprSubfield::TExprSubfield(const TExpressionP& x, const string& spath)
+    : arg(x), subpath(spath)
+{
+    compilePath();
+}
+
+TExprSubfield::TExprSubfield(const TExpressionP& x, const TExpressionP& e, bool index)
+    : arg(x), expr(e), is_index(index)
+{
+    compilePath();
+}
+
+void TExprSubfield::collectFields(FieldUsage& used, bool at_root) const
+{
+    // The subfield is inside the value of arg
+    arg->collectFields(used, at_root);
+    if (expr) {
+        expr->collectFields(used, at_root);
+    }
+}
+
+void TExprSubfield::compilePath()
+{
+    const FieldPath* p = arg->getConstPath();
+    if (!p) {
+        return;
+    }
+    string s;
+    if (!subpath.empty()) {
+        s = subpath;
+    } else if (!expr) {
+        return;
+    } else if (is_index) {
+        TExprIntConst* inx = dynamic_cast<TExprIntConst*>(expr.get());
+        if (!inx) {
+            return;
+        }
+        s = "["+to_string((size_t)inx->value())+"]";
+    } else {
+        const FieldPath* sp = expr->getConstPath();
+        if (!sp) {
+            return;
+        }
+        s = "."+sp->str();
+    }
+    path = FieldPath(p->str()+s);
+    const_path = true;
+}
+
 string TExprSubfield::getSubpath(TQContext& ctx)
 {
     if (!subpath.empty()) {
@@ -2053,6 +3520,9 @@ bool TExprSubfield::isString(TQContext* ctx)
     if (!ctx) {
         return false;
     }
+    if (const_path) {
+        return ctx->isString(path);
+    }
     if (isField()) {
         return ctx->isString(getFieldPath(*ctx));
     }
@@ -2064,6 +3534,9 @@ bool TExprSubfield::isDouble(TQContext* ctx)
     if (!ctx) {
         return false;
     }
+    if (const_path) {
+        return ctx->isDouble(path);
+    }
     if (isField()) {
         return ctx->isDouble(getFieldPath(*ctx));
     }
@@ -2076,6 +3549,9 @@ bool TExprSubfield::isInt(TQContext* ctx)
     if (!ctx) {
         return false;
     }
+    if (const_path) {
+        return ctx->isInt(path);
+    }
     if (isField()) {
         return ctx->isInt(getFieldPath(*ctx));
     }
@@ -2087,6 +3563,9 @@ bool TExprSubfield::isBool(TQContext* ctx)
     if (!ctx) {
         return false;
     }
+    if (const_path) {
+        return ctx->isBool(path);
+    }
     if (isField()) {
         return ctx->isBool(getFieldPath(*ctx));
     }
@@ -2095,6 +3574,9 @@ bool TExprSubfield::isBool(TQContext* ctx)
 
 bool TExprSubfield::exists(TQContext& ctx)
 {
+    if (const_path) {
+        return ctx.exists(path);
+    }
     string field = getFieldPath(ctx);
     return ctx.exists(field);
 }
@@ -2102,11 +3584,14 @@ bool TExprSubfield::exists(TQContext& ctx)
 
 JSONValueP TExprSubfield::getJSON(TQContext& ctx)
 {
+    if (const_path) {
+        return ctx.getJSON(path);
+    }
     if (isField()) {
         return ctx.getJSON(getFieldPath(ctx));
     }
     if (arg->isField() && subpath.empty()&&!expr && is_index) {
-        JSONValueP res(new JSONValue(rapidjson::kArrayType));
+        JSONValueP res = make_shared<JSONValue>(rapidjson::kArrayType);
         string path = arg->getFieldPath(ctx);
         if (path==".") {
             path.clear();
@@ -2114,22 +3599,22 @@ JSONValueP TExprSubfield::getJSON(TQContext& ctx)
         int size = ctx.getArraySize(path);
         for (int i=0; i<size; ++i) {
             JSONValueP v = ctx.getJSON(path+"["+to_string(i)+"]");
-            res->PushBack(*v,ctx.doc->GetAllocator());
+            res->PushBack(JSONValue(*v, ctx.scratch), ctx.scratch);
         }
         if (size==0) {
             JSONValueP v = ctx.getJSON(path);
-            res->PushBack(*v,ctx.doc->GetAllocator());
+            res->PushBack(JSONValue(*v, ctx.scratch), ctx.scratch);
         }
         return res;
     }
 
     JSONValueP val = arg->getJSON(ctx);
     if (val->IsNull()) {
-        return JSONValueP(new JSONValue);
+        return nullJSON();
     }
     string s = getSubpath(ctx);
     if (s.empty()||s==".") {
-        return JSONValueP(new JSONValue);
+        return nullJSON();
     }
     ctx.startLocalJSON(val);
     JSONValueP res = ctx.findLocalPath(s);
@@ -2190,8 +3675,8 @@ JSONValueP TExprSplit::getJSON(TQContext& ctx)
     string s = expr->getString(ctx);
     string d = delim->getString(ctx);
     vector<string> vec = split_string(s, d);
-    auto& alloc = ctx.doc->GetAllocator();
-    JSONValueP res(new JSONValue(rapidjson::kArrayType));
+    auto& alloc = ctx.scratch;
+    JSONValueP res = make_shared<JSONValue>(rapidjson::kArrayType);
     for (const string& s: vec) {
         JSONValue str_val(s.c_str(),alloc);
         res->PushBack(str_val, alloc);
@@ -2303,14 +3788,16 @@ bool TExprTypeCast::getBool(TQContext& ctx)
     return arg->getBool(ctx);
 }
 
-TQAggregateDataP TExprAggregate::getData(TQContext& ctx)
+const TQAggregateDataP& TExprAggregate::getData(TQContext& ctx)
 {
-    TQData* ctx_data = ctx.data();
-    auto it = data_map.find(ctx_data);
-    if (it!=data_map.end()) {
-        return it->second;
+    auto& aggregates = ctx.data()->aggregates;
+    for (auto& a: aggregates) {
+        if (a.first==this) {
+            return a.second;
+        }
     }
-    return data_map[ctx_data] = makeData();
+    aggregates.emplace_back(this, makeData());
+    return aggregates.back().second;
 }
 
 bool TExprAggregate::isInt(TQContext* ctx)
@@ -2341,7 +3828,7 @@ double TExprAggregate::getDouble(TQContext& ctx)
 
 TQAggregateDataP TExprCount::makeData()
 {
-    return TQAggregateDataP(new TExprCountData(this));
+    return make_shared<TExprCountData>(this);
 }
 
 int64_t TExprCountData::getInt(TQContext& ctx)
@@ -2352,9 +3839,14 @@ int64_t TExprCountData::getInt(TQContext& ctx)
     return ++count;
 }
 
+void TExprCountData::merge(const TQAggregateDataP& other)
+{
+    count += static_cast<TExprCountData*>(other.get())->count;
+}
+
 TQAggregateDataP TExprSum::makeData()
 {
-    return TQAggregateDataP(new TExprSumData(this));
+    return make_shared<TExprSumData>(this);
 }
 
 bool TExprSum::isDouble(TQContext* ctx)
@@ -2385,10 +3877,20 @@ double TExprSumData::getDouble(TQContext& ctx)
     return sum_d += expr->arg->getDouble(ctx);
 }
 
+void TExprSumData::merge(const TQAggregateDataP& other)
+{
+    const TExprSumData* o = static_cast<TExprSumData*>(other.get());
+    if (is_double || o->is_double) {
+        sum_d = (is_double?sum_d:sum) + (o->is_double?o->sum_d:o->sum);
+        is_double = true;
+    }
+    sum += o->sum;
+}
+
 
 TQAggregateDataP TExprAvg::makeData()
 {
-    return TQAggregateDataP(new TExprAvgData(this));
+    return make_shared<TExprAvgData>(this);
 }
 
 int64_t TExprAvgData::getInt(TQContext& ctx)
@@ -2406,9 +3908,16 @@ double TExprAvgData::getDouble(TQContext& ctx)
     return sum/count;
 }
 
+void TExprAvgData::merge(const TQAggregateDataP& other)
+{
+    const TExprAvgData* o = static_cast<TExprAvgData*>(other.get());
+    sum += o->sum;
+    count += o->count;
+}
+
 TQAggregateDataP TExprMinmax::makeData()
 {
-    return TQAggregateDataP(new TExprMinmaxData(this));
+    return make_shared<TExprMinmaxData>(this);
 }
 
 bool TExprMinmax::isDouble(TQContext* ctx)
@@ -2459,9 +3968,36 @@ double TExprMinmaxData::getDouble(TQContext& ctx)
     return num_d;
 }
 
+void TExprMinmaxData::merge(const TQAggregateDataP& other)
+{
+    const TExprMinmaxData* o = static_cast<TExprMinmaxData*>(other.get());
+    if (o->first) {
+        return;
+    }
+    if (first) {
+        num = o->num;
+        num_d = o->num_d;
+        is_double = o->is_double;
+        first = false;
+        return;
+    }
+    if (is_double || o->is_double) {
+        double d = o->is_double?o->num_d:o->num;
+        if (!is_double) {
+            num_d = num;
+        }
+        is_double = true;
+        if ((expr->max && num_d<d) || (!expr->max && num_d>d)) {
+            num_d = d;
+        }
+    } else if ((expr->max && num<o->num) || (!expr->max && num>o->num)) {
+        num = o->num;
+    }
+}
+
 JSONValueP TExprPrev::getJSON(TQContext& ctx)
 {
-    JSONValueP v = JSONValueP(new JSONValue(ctx.data()->getJSON(ctx)));
+    JSONValueP v = make_shared<JSONValue>(ctx.data()->getJSON(ctx));
     if (v->IsNull()) {
         return dfault->asJSON(ctx);
     }
@@ -2486,20 +4022,21 @@ JSONValueP TExprCall::getJSON(TQContext& ctx)
     TQDataP call;
     Function& f = ctx.getFunc(proc);
     if (!f.body) {
-        return JSONValueP(new JSONValue);
+        return nullJSON();
     }
     if (ctx.in_key) {
         call = f.body->makeData();
     } else {
-        auto it = data_map.find(ctx_data);
-        if (it!=data_map.end()) {
+        auto& calls = ctx_data->calls;
+        auto it = calls.find(this);
+        if (it!=calls.end()) {
             call =  it->second;
         } else {
-            call =  data_map[ctx_data] = f.body->makeData();
+            call =  calls[this] = f.body->makeData();
         }
     }
     if (args.size()!=f.params.size()) {
-        return JSONValueP(new JSONValue);
+        return nullJSON();
     }
     for (int i=0; i<f.params.size(); ++i) {
         ctx.addVar(f.params[i], args[i]->asJSON(ctx));
@@ -2508,7 +4045,7 @@ JSONValueP TExprCall::getJSON(TQContext& ctx)
     if (!ctx.in_get_JSON) {
         call->processData(ctx);
     }
-    JSONValueP res = JSONValueP(new JSONValue(call->getJSON(ctx)));
+    JSONValueP res = make_shared<JSONValue>(call->getJSON(ctx));
     for (int i=0; i<f.params.size(); ++i) {
         ctx.popVar(f.params[i]);
     }
@@ -2607,27 +4144,29 @@ JSONValueP TExprFile::getJSON(TQContext& ctx)
 {
     string file_name = filename->getString(ctx);
     if (file_name.empty()) {
-        return JSONValueP(new JSONValue);
-    }
-    FILE* fp = fopen(file_name.c_str(), "r");
-    if (!fp) {
-        cerr<<"Warning: failed opening file "<<file_name<<endl;
-        return JSONValueP(new JSONValue);
+        return nullJSON();
     }
+    return DocumentCache::instance().get(file_name, "json", [&]() {
+        FILE* fp = fopen(file_name.c_str(), "r");
+        if (!fp) {
+            cerr<<"Warning: failed opening file "<<file_name<<endl;
+            return nullJSON();
+        }
 
-    json = JSONValueP(new Document);
-    Document& json_doc = *static_cast<Document*>(json.get());
+        JSONValueP json(new Document);
+        Document& json_doc = *static_cast<Document*>(json.get());
 
-    char readBuffer[65536];
-    FileReadStream jsonfile(fp, readBuffer, sizeof(readBuffer));
-    json_doc.ParseStream<kParseCommentsFlag>(jsonfile);
-    fclose(fp);
-    if (json_doc.HasParseError()) {
-        cerr<<"File: "<<file_name<<" Not a valid JSON\n";
-        cerr<<"Error(offset "<<static_cast<unsigned>(json_doc.GetErrorOffset())<<"): "<<GetParseError_En(json_doc.GetParseError())<<endl;
-        return JSONValueP(new JSONValue);        
-    }
-    return json;
+        char readBuffer[65536];
+        FileReadStream jsonfile(fp, readBuffer, sizeof(readBuffer));
+        json_doc.ParseStream<kParseCommentsFlag>(jsonfile);
+        fclose(fp);
+        if (json_doc.HasParseError()) {
+            cerr<<"File: "<<file_name<<" Not a valid JSON\n";
+            cerr<<"Error(offset "<<static_cast<unsigned>(json_doc.GetErrorOffset())<<"): "<<GetParseError_En(json_doc.GetParseError())<<endl;
+            return nullJSON();        
+        }
+        return json;
+    });
 }
 
 bool TExprFile::exists(TQContext& ctx)
@@ -2646,20 +4185,32 @@ string TExprFile::getFilename(TQContext& ctx)
     return filename->getString(ctx);
 }
 
+JSONValueP TExprLookup::getJSON(TQContext& ctx)
+{
+    JSONValueP src = source->getJSON(ctx);
+    int i = ctx.lookup(this, src, key_path, value->getString(ctx));
+    if (i<0) {
+        return nullJSON();
+    }
+    return JSONValueP(src, &src->GetArray()[i]);
+}
+
 JSONValueP TExprCSV::getJSON(TQContext& ctx)
 {
     string file_name = filename->getString(ctx);
     if (file_name.empty()) {
-        return JSONValueP(new JSONValue);
-    }
-    ifstream is(file_name);
-    if (is.fail()) {
-        cerr<<"Warning: failed opening file "<<file_name<<endl;
-        return JSONValueP(new JSONValue);
-    }
-
-    json = readCSV(is, delim, with_header);
-    return json;
+        return nullJSON();
+    }
+    // The delimiter and headers option are part of the format, since they change the resulting document
+    string format = "csv"+to_string(with_header)+delim;
+    return DocumentCache::instance().get(file_name, format, [&]() {
+        ifstream is(file_name);
+        if (is.fail()) {
+            cerr<<"Warning: failed opening file "<<file_name<<endl;
+            return nullJSON();
+        }
+        return readCSV(is, delim, with_header);
+    });
 }
 
 
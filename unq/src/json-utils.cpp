@@ -1,8 +1,15 @@
 #include "json-utils.h"
 #include "utils.h"
 #include <algorithm>
+#include <charconv>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <filesystem>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 using namespace rapidjson;
@@ -119,6 +126,29 @@ string ObjectFieldSet::toString() const
     return res;
 }
 
+const JSONValueP& nullJSON()
+{
+    // One per thread, so that threads do not contend on its reference count
+    thread_local JSONValueP null_value = std::make_shared<JSONValue>();
+    return null_value;
+}
+
+size_t JSONHash::operator()(const JSONValue* v) const
+{
+    switch (v->GetType()) {
+    case rapidjson::kStringType:
+        return std::hash<std::string_view>()(std::string_view(v->GetString(), v->GetStringLength()));
+    case rapidjson::kNumberType: {
+        // Equal numbers have the same double value, and +0.0 equals -0.0
+        double d = v->GetDouble();
+        return std::hash<double>()(d==0?0:d);
+    }
+    default:
+        // Arrays and objects all fall into one bucket per type, so they are compared one by one
+        return v->GetType();
+    }
+}
+
 string valToString(const JSONValue* val)
 {
     if (val->IsString()) {
@@ -140,7 +170,7 @@ std::string valToString(const JSONValueP& val)
 }
 
 
-double valToDouble(const JSONValueP& val)
+double valToDouble(const JSONValue* val)
 {
     if (val->IsDouble()) {
         return val->GetDouble();
@@ -150,6 +180,11 @@ double valToDouble(const JSONValueP& val)
     return {};
 }
 
+double valToDouble(const JSONValueP& val)
+{
+    return valToDouble(val.get());
+}
+
 int64_t valToInt(const JSONValueP& val)
 {
     if (val->IsInt64()) {
@@ -198,60 +233,235 @@ std::string joinAllVals(const JSONValue& val, const string& delim)
 
 JSONValueP readCSV(istream& is, const std::string& delim, bool with_header)
 {
-    vector<string> columns;
-    if (with_header) {
-        string header;
-        getline(is, header);
-        if (header.back()=='\r') {
-            header.pop_back();
+    JSONValueP json(new Document(kArrayType));
+    auto& alloc = static_cast<Document*>(json.get())->GetAllocator();
+    CSVReader reader(is, delim, with_header, &alloc);
+    JSONValue row;
+    while (reader.nextRow(row, alloc)) {
+        json->PushBack(row, alloc);
+    }
+    return json;
+}
+
+// Fields that look like numbers or booleans are converted, and anything else is a string
+static JSONValue csvValue(string_view s, JSONValue::AllocatorType& alloc)
+{
+    if (is_number(s)) {
+        if (s.find('.')==string_view::npos) {
+            int64_t i;
+            if (from_chars(s.data(), s.data()+s.size(), i).ec==errc()) {
+                return JSONValue(i);
+            }
         }
-        columns = split_string(header,delim);
+        double d = 0;
+        from_chars(s.data(), s.data()+s.size(), d);
+        return JSONValue(d);
+    } else if (s=="true") {
+        return JSONValue(true);
+    } else if (s=="false") {
+        return JSONValue(false);
     }
-    JSONValueP json(new Document);
-    Document& json_doc = *static_cast<Document*>(json.get());
-    auto& alloc = json_doc.GetAllocator();
-    JSONValueP vec(new JSONValue(rapidjson::kArrayType));
-    while (!is.eof()) {
-        string line;
-        getline(is, line);
-        if (!line.empty() && line.back()=='\r') {
-            line.pop_back();
+    return JSONValue(s.data(), static_cast<SizeType>(s.size()), alloc);
+}
+
+CSVReader::CSVReader(istream& i, const string& d, bool with_header, JSONValue::AllocatorType* a):
+    is(i), delim(d), key_alloc(a)
+{
+    if (with_header && nextRecord()) {
+        for (auto [pos, len]: fields) {
+            addColumn(line.substr(pos, len));
         }
-        if (line.empty()) {
-            continue;
+    }
+}
+
+void CSVReader::addColumn(string name)
+{
+    columns.push_back(move(name));
+    const string& col = columns.back();
+    if (key_alloc) {
+        char* copy = static_cast<char*>(key_alloc->Malloc(col.size()+1));
+        memcpy(copy, col.c_str(), col.size()+1);
+        keys.emplace_back(copy, col.size());
+    } else {
+        keys.emplace_back(col);
+    }
+}
+
+bool CSVReader::nextRow(JSONValue& row, JSONValue::AllocatorType& alloc)
+{
+    if (!nextRecord()) {
+        return false;
+    }
+    row.SetObject();
+    row.MemberReserve(static_cast<SizeType>(fields.size()), alloc);
+    for (size_t i=0; i<fields.size(); ++i) {
+        if (i==keys.size()) {
+            addColumn(to_string(i));
         }
-        vector<string> values = split_string(line, delim);
-        JSONValue obj(rapidjson::kObjectType);
-        for (int i=0; i<values.size(); ++i) {
-            string key;
-            if (i<columns.size()) {
-                key = columns[i];
-            } else {
-                key = to_string(i);
-            }
-            JSONValue key_val(key.c_str(), alloc);
-            JSONValue value_val;
-            string& val = values[i];
-            if (is_number(val)) {
-                if (val.find('.')==string::npos) {
-                    value_val = JSONValue((int64_t)stoll(val));
-                } else {
-                    value_val = JSONValue(stod(val));
+        JSONValue key(StringRef(keys[i].data(), static_cast<SizeType>(keys[i].size())));
+        JSONValue value = csvValue(string_view(line).substr(fields[i].first, fields[i].second), alloc);
+        row.AddMember(key, value, alloc);
+    }
+    return true;
+}
+
+// Split the next non-empty record into fields
+bool CSVReader::nextRecord()
+{
+    fields.clear();
+    auto next_line = [&](string& s) {
+        if (!getline(is, s)) {
+            return false;
+        }
+        if (!s.empty() && s.back()=='\r') {
+            s.pop_back();
+        }
+        return true;
+    };
+    do {
+        if (!next_line(line)) {
+            return false;
+        }
+    } while (line.empty());
+
+    string more;
+    size_t pos = 0;
+    while (true) {
+        size_t start = pos;
+        if (pos<line.size() && line[pos]=='"') {
+            // A quoted field, which is unescaped in place (and may continue on the following lines)
+            start = ++pos;
+            size_t end = pos;
+            while (true) {
+                if (pos==line.size()) {
+                    if (!next_line(more)) {
+                        break;
+                    }
+                    line += '\n';
+                    line += more;
+                }
+                char c = line[pos++];
+                if (c=='"') {
+                    if (pos==line.size() || line[pos]!='"') {
+                        break;
+                    }
+                    pos++;
                 }
-            } else if (val=="true") {
-                value_val = JSONValue(true);
-            } else if (val=="false") {
-                value_val = JSONValue(false);
-            } else {
-                value_val = JSONValue(values[i].c_str(), alloc);
+                line[end++] = c;
             }
-            obj.AddMember(key_val, value_val, alloc);
+            fields.emplace_back(start, end-start);
+            // Anything between the closing quote and the delimiter is ignored
+            pos = min(line.find(delim, pos), line.size());
+        } else {
+            pos = min(line.find(delim, pos), line.size());
+            fields.emplace_back(start, pos-start);
+        }
+        if (pos==line.size()) {
+            return true;
+        }
+        pos += delim.size();
+        // A delimiter at the end of the line doesn't start another field (unless it's a quoted empty one)
+        if (pos==line.size()) {
+            return true;
         }
-        vec->PushBack(obj, alloc);
     }
-    *json = *vec;
-    return json;
+}
+
+DocumentCache& DocumentCache::instance()
+{
+    static DocumentCache cache;
+    return cache;
+}
+
+void DocumentCache::setLimit(size_t bytes)
+{
+    lock_guard<mutex> lock(mtx);
+    limit = bytes;
+    evict();
+}
 
+JSONValueP DocumentCache::get(const string& filename, const string& format, const function<JSONValueP()>& load)
+{
+    struct stat st;
+    if (stat(filename.c_str(), &st)!=0) {
+        return load();
+    }
+    string key = filesystem::absolute(filename).lexically_normal().string()+'\0'+format;
+    auto same_file = [&](const Entry& e) {
+        return e.size==st.st_size && e.mtime.tv_sec==st.st_mtim.tv_sec && e.mtime.tv_nsec==st.st_mtim.tv_nsec;
+    };
+    {
+        lock_guard<mutex> lock(mtx);
+        auto it = index.find(key);
+        if (it!=index.end()) {
+            if (same_file(*it->second)) {
+                entries.splice(entries.begin(), entries, it->second);
+                return it->second->doc;
+            }
+            total -= it->second->bytes;
+            entries.erase(it->second);
+            index.erase(it);
+        }
+    }
+
+    // Loading is done without holding the lock, so that other threads can use the cache meanwhile
+    JSONValueP doc = load();
+    if (doc==nullJSON()) {
+        return doc;
+    }
+    size_t bytes = static_cast<Document*>(doc.get())->GetAllocator().Size();
+    lock_guard<mutex> lock(mtx);
+    if (bytes>limit || index.count(key)>0) {
+        return doc;
+    }
+    entries.push_front({key, st.st_size, st.st_mtim, bytes, doc});
+    index[key] = entries.begin();
+    total += bytes;
+    evict();
+    return doc;
+}
+
+void DocumentCache::evict()
+{
+    while (total>limit) {
+        total -= entries.back().bytes;
+        index.erase(entries.back().key);
+        entries.pop_back();
+    }
+}
+
+MappedFile::MappedFile(const string& fname)
+{
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd<0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st)==0) {
+        len = st.st_size;
+        if (len==0) {
+            opened = true;
+        } else {
+            int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+            // The whole file is going to be read anyway, so avoid a page fault for each page
+            flags |= MAP_POPULATE;
+#endif
+            void* p = mmap(nullptr, len, PROT_READ|PROT_WRITE, flags, fd, 0);
+            if (p!=MAP_FAILED) {
+                buf = static_cast<char*>(p);
+                opened = true;
+            }
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (buf) {
+        munmap(buf, len);
+    }
 }
 
 } // namespace xcite
@@ -1,9 +1,11 @@
 // Copyright (c) 2022 by Sela Mador-Haim
 
 #include "params.h"
+#include "utils.h"
 #include "shared/version.h"
 #include "rapidjson/document.h"
 #include "rapidjson/filereadstream.h"
+#include "rapidjson/filewritestream.h"
 #include "rapidjson/stringbuffer.h"
 #include <rapidjson/writer.h>
 #include "rapidjson/error/en.h"
@@ -15,6 +17,9 @@
 #include <string>
 #include <memory>
 #include <filesystem>
+#include <thread>
+#include <future>
+#include <atomic>
 
 using namespace std;
 using namespace rapidjson;
@@ -23,86 +28,745 @@ using namespace xcite;
 typedef std::shared_ptr<rapidjson::Document> json_documentP;
 using recursive_directory_iterator = std::filesystem::recursive_directory_iterator;
 
-void process_json_file(TQDataP& tq, TQContext& ctx, const string& fname, bool use_stdin)
+FILE* open_json_file(const string& fname, string& filename, bool use_stdin)
 {
-    string filename;
-    //cerr<<"Filename: "<<filename<<endl;
-    FILE* fp;
     if (use_stdin) {
-        fp = stdin;
         filename = "stdin";
-    } else {
-        filename = fname;
-        fp = fopen(filename.c_str(), "r");
-        if (!fp) {
-            cerr<<"Error. Could not open JSON file: "<<filename<<endl;
-            exit(1);
+        return stdin;
+    }
+    filename = fname;
+    FILE* fp = fopen(filename.c_str(), "r");
+    if (!fp) {
+        cerr<<"Error. Could not open JSON file: "<<filename<<endl;
+        exit(1);
+    }
+    return fp;
+}
+
+void process_json_value(TQDataP& tq, TQContext& ctx, const JSONValueP& json_val, const string& filename)
+{
+    try {
+        ctx.reset({}, {});
+        ctx.startLocalJSON(json_val);
+        ctx.pushFilename(filename);
+        tq->processData(ctx);
+        ctx.popFilename();
+    } catch (QueryError& e) {
+        cerr<<"In file: "<<filename<<", ";
+        cerr<<e.message()<<endl;
+        exit(1);
+    }
+}
+
+// SAX handler that passes to a target document everything except the top-level members that the query 
+// doesn't use. These are skipped without being stored.
+class FieldFilter
+{
+public:
+    FieldFilter(Document& t, const FieldUsage& u): target(t), used(u) {}
+
+    bool Null() {return skipValue() || target.Null();}
+    bool Bool(bool b) {return skipValue() || target.Bool(b);}
+    bool Int(int i) {return skipValue() || target.Int(i);}
+    bool Uint(unsigned i) {return skipValue() || target.Uint(i);}
+    bool Int64(int64_t i) {return skipValue() || target.Int64(i);}
+    bool Uint64(uint64_t i) {return skipValue() || target.Uint64(i);}
+    bool Double(double d) {return skipValue() || target.Double(d);}
+    bool RawNumber(const char* s, SizeType len, bool copy) {return skipValue() || target.RawNumber(s, len, copy);}
+    bool String(const char* s, SizeType len, bool copy) {return skipValue() || target.String(s, len, copy);}
+    bool StartObject() {return skipStart() || start([&]{return target.StartObject();});}
+    bool Key(const char* s, SizeType len, bool copy) {
+        if (skip>0) {
+            return true;
+        }
+        if (depth==1) {
+            if (!used.contains(string_view(s, len))) {
+                skip = 1;
+                return true;
+            }
+            kept++;
+        }
+        return target.Key(s, len, copy);
+    }
+    bool EndObject(SizeType n) {
+        if (skipEnd()) {
+            return true;
         }
+        // Only the members that were kept are on the target's stack
+        return target.EndObject(--depth==0?kept:n);
+    }
+    bool StartArray() {return skipStart() || start([&]{return target.StartArray();});}
+    bool EndArray(SizeType n) {
+        if (skipEnd()) {
+            return true;
+        }
+        depth--;
+        return target.EndArray(n);
+    }
 
+private:
+    // Skipping a member: 1 until its value starts, and then the nesting level within the value plus one
+    bool skipValue() {
+        if (skip==1) {
+            skip = 0;
+            return true;
+        }
+        return skip>0;
     }
+    bool skipStart() {
+        if (skip>0) {
+            skip++;
+            return true;
+        }
+        return false;
+    }
+    bool skipEnd() {
+        if (skip>0) {
+            if (--skip==1) {
+                skip = 0;
+            }
+            return true;
+        }
+        return false;
+    }
+    template <typename F>
+    bool start(F f) {
+        depth++;
+        return f();
+    }
+
+    Document& target;
+    const FieldUsage& used;
+    int depth = 0;
+    int skip = 0;
+    SizeType kept = 0;
+};
+
+// Parse the next JSON value of the stream, keeping only the top-level members that are used
+template <unsigned flags, typename Stream>
+ParseResult parse_json(Document& doc, Stream& is, const FieldUsage& used)
+{
+    if (used.usesAll()) {
+        doc.ParseStream<flags>(is);
+        return doc;
+    }
+    Reader reader;
+    ParseResult res;
+    auto generator = [&](Document& d) {
+        FieldFilter filter(d, used);
+        res = reader.Parse<flags>(is, filter);
+        return !res.IsError();
+    };
+    doc.Populate(generator);
+    return res;
+}
+
+void exit_on_parse_error(const ParseResult& res)
+{
+    if (res.IsError()) {
+        cerr<<"Not a valid JSON\n";
+        cerr<<"Error(offset "<<static_cast<unsigned>(res.Offset())<<"): "<<GetParseError_En(res.Code())<<endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+void process_json_file(TQDataP& tq, TQContext& ctx, const string& fname, const FieldUsage& used, bool use_stdin)
+{
+    string filename;
+    FILE* fp = open_json_file(fname, filename, use_stdin);
     char readBuffer[65536];
     FileReadStream jsonfile(fp, readBuffer, sizeof(readBuffer));
     while (jsonfile.Peek()!=EOF) {
         JSONValueP json_val(new Document);
         Document& json_doc = *static_cast<Document*>(json_val.get());
-        json_doc.ParseStream<kParseCommentsFlag|kParseStopWhenDoneFlag>(jsonfile);
-        if (json_doc.HasParseError()) {
-            if (json_doc.GetParseError()==kParseErrorDocumentEmpty) {
-                break;
-            }
-            cerr<<"Not a valid JSON\n";
-            cerr<<"Error(offset "<<static_cast<unsigned>(json_doc.GetErrorOffset())<<"): "<<GetParseError_En(json_doc.GetParseError())<<endl;
-            exit(EXIT_FAILURE);
+        ParseResult res = parse_json<kParseCommentsFlag|kParseStopWhenDoneFlag>(json_doc, jsonfile, used);
+        if (res.Code()==kParseErrorDocumentEmpty) {
+            break;
+        }
+        exit_on_parse_error(res);
+        process_json_value(tq, ctx, json_val, filename);
+    }
+    fclose(fp);
+}
+
+// Parse the JSON values in a buffer in situ, so that strings are not copied, and call f with each of them.
+// The buffer (and the allocator, if given) must outlive the values.
+template <typename F>
+ParseResult parse_json_buffer(char* begin, char* end, const FieldUsage& used, F f, MemoryPoolAllocator<>* alloc = nullptr)
+{
+    InsituBufferStream jsonfile(begin, end);
+    while (true) {
+        JSONValueP json_val(new Document(alloc));
+        Document& json_doc = *static_cast<Document*>(json_val.get());
+        ParseResult res = parse_json<kParseInsituFlag|kParseCommentsFlag|kParseStopWhenDoneFlag>(json_doc, jsonfile, used);
+        if (res.Code()==kParseErrorDocumentEmpty) {
+            return ParseResult();
         }
-        try {
-            ctx.reset({}, {});
-            ctx.startLocalJSON(json_val);
-            ctx.pushFilename(filename);
-            tq->processData(ctx);
-            ctx.popFilename();
-        } catch (QueryError& e) {
-            cerr<<"In file: "<<filename<<", ";
-            cerr<<e.message()<<endl;
+        if (res.IsError()) {
+            return res;
+        }
+        f(json_val);
+    }
+}
+
+// The value, also owning owner, for a value that refers to memory that owner keeps (e.g. a buffer parsed in situ).
+// Holding the value, e.g. in a cache, then keeps that memory alive, so that it can't be reused by other values.
+template <typename Owner>
+JSONValueP co_owned(const JSONValueP& value, const shared_ptr<Owner>& owner)
+{
+    auto both = make_shared<pair<JSONValueP, shared_ptr<Owner> > >(value, owner);
+    return JSONValueP(both, value.get());
+}
+
+// Process a JSON file that is mapped into memory and parsed in situ, so that strings are not copied.
+void process_json_mapped_file(TQDataP& tq, TQContext& ctx, const string& filename, const FieldUsage& used)
+{
+    MappedFile file(filename);
+    if (!file.isOpen()) {
+        cerr<<"Error. Could not open JSON file: "<<filename<<endl;
+        exit(1);
+    }
+    exit_on_parse_error(parse_json_buffer(file.begin(), file.end(), used, [&](const JSONValueP& json_val) {
+        process_json_value(tq, ctx, json_val, filename);
+    }));
+}
+
+bool read_file(const string& filename, vector<char>& buffer)
+{
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    error_code ec;
+    uintmax_t size = filesystem::file_size(filename, ec);
+    // One byte more than the expected size, so that reaching the end of the file doesn't grow the buffer
+    buffer.resize(ec?65536:size+1);
+    size_t len = 0;
+    while (size_t n = fread(buffer.data()+len, 1, buffer.size()-len, fp)) {
+        len += n;
+        if (len==buffer.size()) {
+            buffer.resize(len*2);
+        }
+    }
+    buffer.resize(len);
+    fclose(fp);
+    return true;
+}
+
+// A JSON file that is read and parsed ahead of the query evaluation
+struct PrefetchedFile {
+    string filename;
+    bool opened = false;
+    // The file's contents and the allocator of the parsed values, which the values refer to (so the values 
+    // are evaluated with co_owned())
+    vector<char> buffer;
+    MemoryPoolAllocator<> allocator;
+    vector<JSONValueP> values;
+    ParseResult result;
+};
+typedef shared_ptr<PrefetchedFile> PrefetchedFileP;
+
+struct PrefetchTask {
+    PrefetchedFileP file = make_shared<PrefetchedFile>();
+    promise<PrefetchedFileP> done;
+};
+typedef shared_ptr<PrefetchTask> PrefetchTaskP;
+
+// Process JSON files in a pipeline: reader threads read the files into memory and parser threads parse them,
+// while the query is evaluated on the files that are already parsed, in the order of the input.
+// Up to files_ahead files are kept in memory ahead of the one being evaluated.
+void process_json_files_pipelined(
+    TQDataP& tq, 
+    TQContext& ctx, 
+    const vector<string>& files, 
+    const FieldUsage& used, 
+    int threads)
+{
+    size_t files_ahead = 4*threads;
+    // The only limit on the number of files ahead: a file is added to pending before it's read, and removed 
+    // when the evaluation waits for it, so pending holds the other files_ahead-1 of them. to_read and to_parse 
+    // hold files that are in pending, so they don't need a limit of their own.
+    BoundedQueue<future<PrefetchedFileP> > pending(files_ahead-1);
+    BoundedQueue<PrefetchTaskP> to_read(SIZE_MAX);
+    BoundedQueue<PrefetchTaskP> to_parse(SIZE_MAX);
+    vector<thread> workers;
+    workers.emplace_back([&]() {
+        for (const string& f: files) {
+            PrefetchTaskP task = make_shared<PrefetchTask>();
+            task->file->filename = f;
+            pending.push(task->done.get_future());
+            to_read.push(task);
+        }
+        pending.close();
+        to_read.close();
+    });
+    atomic<int> readers_left(threads);
+    for (int i=0; i<threads; ++i) {
+        workers.emplace_back([&]() {
+            PrefetchTaskP task;
+            while (to_read.pop(task)) {
+                task->file->opened = read_file(task->file->filename, task->file->buffer);
+                to_parse.push(task);
+            }
+            if (--readers_left==0) {
+                to_parse.close();
+            }
+        });
+    }
+    for (int i=0; i<threads; ++i) {
+        workers.emplace_back([&]() {
+            PrefetchTaskP task;
+            while (to_parse.pop(task)) {
+                PrefetchedFile& file = *task->file;
+                if (file.opened) {
+                    char* begin = file.buffer.data();
+                    file.result = parse_json_buffer(begin, begin+file.buffer.size(), used, 
+                        [&](const JSONValueP& json_val) {
+                            file.values.push_back(json_val);
+                        }, &file.allocator);
+                }
+                task->done.set_value(task->file);
+            }
+        });
+    }
+
+    future<PrefetchedFileP> next;
+    while (pending.pop(next)) {
+        PrefetchedFileP file = next.get();
+        if (!file->opened) {
+            cerr<<"Error. Could not open JSON file: "<<file->filename<<endl;
             exit(1);
         }
+        for (const JSONValueP& json_val: file->values) {
+            process_json_value(tq, ctx, co_owned(json_val, file), file->filename);
+        }
+        exit_on_parse_error(file->result);
+    }
+    for (thread& th: workers) {
+        th.join();
+    }
+}
+
+// SAX handler that passes to a target document only the events of the elements of the array at a given path.
+// Everything else is skipped. Parsing stops if the value at the path is not an array.
+class StreamSplitter
+{
+public:
+    StreamSplitter(const vector<string>& p): path(p) {}
+
+    void setTarget(Document* t) {
+        target = t;
+        element_done = false;
+    }
+    bool elementDone() const {return element_done;}
+    bool notArray() const {return not_array;}
+
+    bool Null() {return scalar([&]{return target->Null();});}
+    bool Bool(bool b) {return scalar([&]{return target->Bool(b);});}
+    bool Int(int i) {return scalar([&]{return target->Int(i);});}
+    bool Uint(unsigned i) {return scalar([&]{return target->Uint(i);});}
+    bool Int64(int64_t i) {return scalar([&]{return target->Int64(i);});}
+    bool Uint64(uint64_t i) {return scalar([&]{return target->Uint64(i);});}
+    bool Double(double d) {return scalar([&]{return target->Double(d);});}
+    bool RawNumber(const char* s, SizeType len, bool copy) {
+        return scalar([&]{return target->RawNumber(s, len, copy);});
+    }
+    bool String(const char* s, SizeType len, bool copy) {
+        return scalar([&]{return target->String(s, len, copy);});
+    }
+    bool StartObject() {return start(false, [&]{return target->StartObject();});}
+    bool Key(const char* s, SizeType len, bool copy) {
+        if (depth>0) {
+            return target->Key(s, len, copy);
+        }
+        frames.back().key.assign(s, len);
+        return true;
+    }
+    bool EndObject(SizeType n) {return end([&]{return target->EndObject(n);});}
+    bool StartArray() {return start(true, [&]{return target->StartArray();});}
+    bool EndArray(SizeType n) {return end([&]{return target->EndArray(n);});}
+
+private:
+    struct Frame {
+        bool is_array;
+        // Whether this array or object is on the path
+        bool on_path;
+        string key;
+    };
+
+    // Is the value that starts now an element to be passed to the target? (Only the array at the path
+    // is on the path at that level.)
+    bool isElement() const {
+        return !frames.empty() && frames.back().on_path && frames.size()-1==path.size();
+    }
+
+    // Is the value that starts now at the path?
+    bool atPath() const {
+        size_t level = frames.size();
+        if (level==0) {
+            return path.empty();
+        }
+        const Frame& parent = frames.back();
+        return parent.on_path && !parent.is_array && level==path.size() && parent.key==path[level-1];
+    }
+
+    // Is the array or object that starts now on the path? Only the last one on the path can be an array.
+    bool onPath(bool is_array) const {
+        size_t level = frames.size();
+        if (level>0) {
+            const Frame& parent = frames.back();
+            if (!parent.on_path || parent.is_array || level>path.size() || parent.key!=path[level-1]) {
+                return false;
+            }
+        }
+        return (level<path.size())?!is_array:is_array;
+    }
+
+    template <typename F>
+    bool scalar(F f) {
+        if (depth>0) {
+            return f();
+        }
+        if (isElement()) {
+            element_done = true;
+            return f();
+        }
+        if (atPath()) {
+            not_array = true;
+            return false;
+        }
+        return true;
+    }
+
+    template <typename F>
+    bool start(bool is_array, F f) {
+        if (depth>0) {
+            depth++;
+            return f();
+        }
+        if (isElement()) {
+            depth = 1;
+            return f();
+        }
+        if (!is_array && atPath()) {
+            not_array = true;
+            return false;
+        }
+        frames.push_back({is_array, onPath(is_array), {}});
+        return true;
+    }
+
+    template <typename F>
+    bool end(F f) {
+        if (depth>0) {
+            depth--;
+            element_done = (depth==0);
+            return f();
+        }
+        frames.pop_back();
+        return true;
+    }
+
+    vector<string> path;
+    vector<Frame> frames;
+    Document* target = nullptr;
+    // Nesting level within the current element
+    int depth = 0;
+    bool element_done = false;
+    bool not_array = false;
+};
+
+// Skip whitespace and comments between top-level JSON values
+void skip_whitespace_and_comments(FileReadStream& is)
+{
+    while (true) {
+        SkipWhitespace(is);
+        if (is.Peek()!='/') {
+            return;
+        }
+        is.Take();
+        if (is.Peek()=='/') {
+            while (is.Peek()!='\0' && is.Take()!='\n');
+        } else if (is.Peek()=='*') {
+            is.Take();
+            char prev = 0;
+            while (is.Peek()!='\0' && !(prev=='*' && is.Peek()=='/')) {
+                prev = is.Take();
+            }
+            if (is.Peek()=='/') {
+                is.Take();
+            }
+        } else {
+            return;
+        }
+    }
+}
+
+// Process a JSON file one element at a time, where elements are the members of the array at the given path.
+// Only one element is kept in memory at any time.
+void process_json_stream(TQDataP& tq, TQContext& ctx, const string& fname, const vector<string>& path, bool use_stdin)
+{
+    const unsigned flags = kParseCommentsFlag|kParseStopWhenDoneFlag;
+    string filename;
+    FILE* fp = open_json_file(fname, filename, use_stdin);
+    char readBuffer[65536];
+    FileReadStream jsonfile(fp, readBuffer, sizeof(readBuffer));
+    Reader reader;
+    StreamSplitter splitter(path);
+    // Feed the next element to a document. Returns false if the end of the current JSON value was reached first.
+    auto next_element = [&](Document& d) {
+        splitter.setTarget(&d);
+        while (!reader.IterativeParseComplete()) {
+            if (!reader.IterativeParseNext<flags>(jsonfile, splitter)) {
+                return false;
+            }
+            if (splitter.elementDone()) {
+                return true;
+            }
+        }
+        return false;
+    };
+    bool done = false;
+    while (!done) {
+        skip_whitespace_and_comments(jsonfile);
+        if (jsonfile.Peek()=='\0') {
+            break;
+        }
+        reader.IterativeParseInit();
+        do {
+            JSONValueP json_val(new Document);
+            static_cast<Document*>(json_val.get())->Populate(next_element);
+            if (splitter.notArray()) {
+                cerr<<"Error: the value at the path of -stream is not an array, in file: "<<filename<<endl;
+                exit(1);
+            }
+            if (reader.HasParseError()) {
+                if (reader.GetParseErrorCode()==kParseErrorDocumentEmpty) {
+                    done = true;
+                    break;
+                }
+                cerr<<"Not a valid JSON\n";
+                cerr<<"Error(offset "<<static_cast<unsigned>(reader.GetErrorOffset())<<"): "<<GetParseError_En(reader.GetParseErrorCode())<<endl;
+                exit(EXIT_FAILURE);
+            }
+            if (splitter.elementDone()) {
+                process_json_value(tq, ctx, json_val, filename);
+            }
+        } while (!reader.IterativeParseComplete());
     }
     fclose(fp);
 }
 
+// Process a CSV file, either as a single array of rows or (when streaming) one row at a time
 void process_csv_file(
     TQDataP& tq, 
     TQContext& ctx, 
     const string& fname, 
     const string& delim, 
     bool with_headers, 
+    bool stream,
     bool use_stdin)
 {
-    JSONValueP json;
-    string file_name;
-    if (use_stdin) {
-        file_name = "stdin";
-        json = readCSV(cin, delim, with_headers);
-    } else {
-        file_name = fname;
-        ifstream is(file_name);
-        if (is.fail()) {
+    string file_name = use_stdin?"stdin":fname;
+    ifstream fs;
+    if (!use_stdin) {
+        fs.open(file_name);
+        if (fs.fail()) {
             cerr<<"Error: failed opening CSV file: "<<file_name<<endl;
             exit(1);
         }
-        json = readCSV(is, delim, with_headers);
-        try {
-            ctx.reset({}, {});
-            ctx.startLocalJSON(json);
-            ctx.pushFilename(file_name);
-            tq->processData(ctx);
-            ctx.popFilename();
-        } catch (QueryError& e) {
-            cerr<<"In file: "<<file_name<<", ";
-            cerr<<e.message()<<endl;
-            exit(1);
+    }
+    istream& is = use_stdin?cin:fs;
+    if (!stream) {
+        process_json_value(tq, ctx, readCSV(is, delim, with_headers), file_name);
+        return;
+    }
+    CSVReader reader(is, delim, with_headers);
+    while (true) {
+        JSONValueP json_val(new Document);
+        Document& json_doc = *static_cast<Document*>(json_val.get());
+        if (!reader.nextRow(json_doc, json_doc.GetAllocator())) {
+            break;
+        }
+        process_json_value(tq, ctx, json_val, file_name);
+    }
+}
+
+struct InputOptions {
+    bool csv = false;
+    string delim = ",";
+    bool csv_headers = true;
+    bool mmap = false;
+    bool stream = false;
+    vector<string> stream_path;
+    // Top-level members of the input documents that are used by the query (the others are not parsed)
+    FieldUsage used_fields;
+};
+
+void process_file(TQDataP& tq, TQContext& ctx, const string& fname, const InputOptions& opts, bool use_stdin)
+{
+    if (opts.csv) {
+        process_csv_file(tq, ctx, fname, opts.delim, opts.csv_headers, opts.stream, use_stdin);
+    } else if (opts.stream) {
+        process_json_stream(tq, ctx, fname, opts.stream_path, use_stdin);
+    } else if (opts.mmap && !use_stdin) {
+        process_json_mapped_file(tq, ctx, fname, opts.used_fields);
+    } else {
+        process_json_file(tq, ctx, fname, opts.used_fields, use_stdin);
+    }
+}
+
+// Split the files into contiguous parts of roughly the same total size, one for each thread.
+// Keeping the parts contiguous means that merging them in order gives the same result as a serial run.
+vector<vector<string> > partition_files(const vector<string>& files, int jobs)
+{
+    vector<uintmax_t> sizes;
+    uintmax_t total = 0;
+    for (const string& f: files) {
+        error_code ec;
+        uintmax_t size = filesystem::is_regular_file(f, ec)?filesystem::file_size(f, ec):0;
+        if (ec) {
+            size = 0;
+        }
+        sizes.push_back(size);
+        total += size;
+    }
+    vector<vector<string> > parts(jobs);
+    uintmax_t acc = 0;
+    int part = 0;
+    for (int i=0; i<files.size(); ++i) {
+        parts[part].push_back(files[i]);
+        acc += sizes[i];
+        size_t files_left = files.size()-i-1;
+        size_t parts_left = jobs-part-1;
+        if (parts_left>0 && (acc>=total/jobs*(part+1) || files_left<=parts_left)) {
+            part++;
+        }
+    }
+    return parts;
+}
+
+// Whether the query has an #assign directive. Assigned variables carry over from one input value to the next,
+// so the values must be processed in order by a single thread.
+bool assigns_variables(const JSONValue& query)
+{
+    if (query.IsArray()) {
+        for (const JSONValue& v: query.GetArray()) {
+            if (assigns_variables(v)) {
+                return true;
+            }
+        }
+    } else if (query.IsObject()) {
+        for (auto& m: query.GetObject()) {
+            string key(m.name.GetString(), m.name.GetStringLength());
+            size_t pos = key.find_first_not_of(" \t\n");
+            if (pos!=string::npos && key[pos]=='#') {
+                pos = key.find_first_not_of(" \t\n", pos+1);
+                if (pos!=string::npos && key.compare(pos, 6, "assign")==0 &&
+                        (pos+6==key.size() || (!isalnum(key[pos+6]) && key[pos+6]!='_'))) {
+                    return true;
+                }
+            }
+            if (assigns_variables(m.value)) {
+                return true;
+            }
         }
     }
-    
+    return false;
+}
+
+// Process files using multiple threads, each with its own data tree and context. The resulting data trees 
+// are merged into the data tree of the first thread, which is returned together with its context.
+TQDataP process_files_parallel(
+    TemplateQueryP& t,
+    vector<shared_ptr<TQContext> >& contexts,
+    const vector<string>& files,
+    int jobs,
+    const InputOptions& opts,
+    bool show_nulls,
+    size_t sort_memory)
+{
+    vector<vector<string> > parts = partition_files(files, jobs);
+    vector<TQDataP> data;
+    for (int i=0; i<jobs; ++i) {
+        contexts.push_back(make_shared<TQContext>());
+        contexts.back()->opt_show_null = show_nulls;
+        contexts.back()->opt_sort_memory = sort_memory;
+        data.push_back(t->makeData());
+    }
+    vector<thread> threads;
+    for (int i=0; i<jobs; ++i) {
+        threads.emplace_back([&, i]() {
+            for (const string& f: parts[i]) {
+                process_file(data[i], *contexts[i], f, opts, false);
+            }
+        });
+    }
+    for (thread& th: threads) {
+        th.join();
+    }
+
+    // Merge with an empty document as the context, so that only the collected data is used
+    TQContext& ctx = *contexts[0];
+    ctx.reset({}, {});
+    ctx.startLocalJSON(JSONValueP(new JSONValue));
+    ctx.in_get_JSON = true;
+    for (int i=1; i<jobs; ++i) {
+        data[0]->merge(data[i], ctx);
+    }
+    ctx.in_get_JSON = false;
+    return data[0];
+}
+
+// Root of the data tree with -per-doc. Each input value is processed with a new data tree, whose result is written
+// right away as a line of compact JSON. The tree is then released, so that memory doesn't grow with the input.
+// Values without a result (e.g. filtered out by #if) are not written.
+class PerDocData: public TQData
+{
+public:
+    PerDocData(TemplateQuery* query, FileWriteStream& os)
+        : q(query), stream(os), writer(os), out(writer) {}
+    virtual bool processData(TQContext& ctx);
+    virtual JSONValue getJSON(TQContext& ctx) {return {};}
+    virtual TemplateQuery* getTQ() {return q;}
+
+private:
+    TemplateQuery* q;
+    FileWriteStream& stream;
+    Writer<FileWriteStream> writer;
+    JSONWriterOutput<Writer<FileWriteStream> > out;
+};
+
+bool PerDocData::processData(TQContext& ctx)
+{
+    TQDataP data = q->makeData();
+    if (data->processData(ctx)) {
+        ctx.in_get_JSON = true;
+        writer.Reset(stream);
+        if (data->writeJSON(ctx, out, nullptr)) {
+            stream.Put('\n');
+            // Each result is written as soon as it's ready, also when the output is a pipe, instead of waiting
+            // for the buffers to fill up
+            stream.Flush();
+            fflush(stdout);
+        }
+        ctx.in_get_JSON = false;
+    }
+    data.reset();
+    TQShared::releaseShared();
+    // The values kept by the data tree were allocated here
+    ctx.doc->GetAllocator().Clear();
+    return false;
+}
+
+template<typename Writer>
+void write_result(const TQDataP& tq, TQContext& ctx, FileWriteStream& os)
+{
+    Writer writer(os);
+    JSONWriterOutput<Writer> out(writer);
+    if (!tq->writeJSON(ctx, out, nullptr)) {
+        writer.Null();
+    }
 }
 
 void print_help_message(int exit_code)
@@ -115,10 +779,26 @@ void print_help_message(int exit_code)
     cerr<<"  -c <query-string>: query as string in the command line.\n";
     cerr<<"  -f <query-file>: a filename containing the query.\n";
     cerr<<"  -show-nulls (or -n): do not hide null values.\n";
+    cerr<<"  -compact: print the result in a single line, without indentation.\n";
+    cerr<<"  -per-doc: evaluate the query on each input value separately, and print each result as soon as it is\n";
+    cerr<<"     ready, in a single line (NDJSON). Values with an empty result are skipped.\n";
     cerr<<"  -csv: input files as csv files, instead of json.\n";
     cerr<<"  -delim <delimiter>: a character (or string) used as a delimiter for csv files.\n";
     cerr<<"  -csv-no-headers: the csv file contains no headers in the first line.\n";
+    cerr<<"  -mmap: map json files into memory and parse them in place, instead of reading and copying them.\n";
+    cerr<<"  -stream <path>: process each element of the array at <path> (. for a top-level array) separately,\n";
+    cerr<<"     without loading the whole file into memory. Field names with dots can be quoted with backticks\n";
+    cerr<<"     (e.g. data.`x.y`). With -csv, the path must be . to process each row of a csv file separately.\n";
     cerr<<"  -r: recursively traverse directories. Instead of a json file list, expect a list of directories.\n";
+    cerr<<"  -j <threads>: process the input files using multiple threads (0 for the number of cores).\n";
+    cerr<<"     Queries with #assign, whose variables carry over between input values, use a single thread.\n";
+    cerr<<"  -file-cache <MB>: memory limit for the files read by $file and $csv, which are parsed once and\n";
+    cerr<<"     kept in memory while they are unchanged (default 512, 0 to read them on every use).\n";
+    cerr<<"  -sort-memory <MB>: memory limit for each sorted array. Beyond it, the elements are sorted and written\n";
+    cerr<<"     to temporary files, and merged when printing the result (default 0, no limit).\n";
+    cerr<<"  -pipeline <threads>: read and parse json files ahead of the query evaluation, with <threads> reader\n";
+    cerr<<"     threads and <threads> parser threads (0 for half the number of cores). Files are still evaluated\n";
+    cerr<<"     in order, and at most 4 files per thread are kept in memory ahead of the evaluation.\n";
     cerr<<endl;
     exit(exit_code);
 }
@@ -128,11 +808,14 @@ int main(int argc, char* argv[])
     Params args(argc, argv);
     string query_file;
     string query_txt;
-    bool csv_opt = false;
-    string delim = ",";
-    bool csv_headers_opt = true;
+    InputOptions input_opts;
     bool show_nulls_opt = false;
+    bool compact_opt = false;
+    bool per_doc_opt = false;
     bool recursive_opt = false;
+    int jobs = 1;
+    int pipeline_threads = 0;
+    size_t sort_memory = 0;
 
     while (!args.isEnd() && args.isOpt()) {
         string arg = args.nextArg();
@@ -142,14 +825,79 @@ int main(int argc, char* argv[])
             query_txt = args.nextArg();
         } else if (arg=="-show-nulls" || arg=="-n") {
             show_nulls_opt = true;
+        } else if (arg=="-compact") {
+            compact_opt = true;
+        } else if (arg=="-per-doc") {
+            per_doc_opt = true;
         } else if (arg=="-csv") {
-            csv_opt = true;
+            input_opts.csv = true;
         } else if (arg=="-csv-no-headers") {
-            csv_headers_opt = false;
+            input_opts.csv_headers = false;
         } else if (arg=="-delim") {
-            delim = args.nextArg();
+            input_opts.delim = args.nextArg();
+        } else if (arg=="-mmap") {
+            input_opts.mmap = true;
+        } else if (arg=="-stream") {
+            string path = args.isEnd()?"":args.nextArg();
+            input_opts.stream = true;
+            // Field names in backticks may contain dots and brackets, as in queries
+            string escaped;
+            for (size_t i=0; i<path.size(); i++) {
+                if (path[i]!='`') {
+                    escaped.push_back(path[i]);
+                    continue;
+                }
+                size_t end = path.find('`', i+1);
+                if (end==string::npos) {
+                    cerr<<"Error: missing closing backtick (`) in the path of -stream\n\n";
+                    print_help_message(1);
+                }
+                escaped += escape_field_name(path.substr(i+1, end-i-1));
+                i = end;
+            }
+            for (const PathStep& step: compilePath(escaped)) {
+                if (step.type!=PathStep::Type::Member) {
+                    cerr<<"Error: -stream expects a path of field names (or . for the top level)\n\n";
+                    print_help_message(1);
+                }
+                input_opts.stream_path.push_back(step.name);
+            }
         } else if (arg=="-r") {
             recursive_opt = true;
+        } else if (arg=="-j") {
+            string n = args.isEnd()?"":args.nextArg();
+            if (!is_number(n) || n.find('.')!=string::npos) {
+                cerr<<"Error: -j expects the number of threads\n\n";
+                print_help_message(1);
+            }
+            jobs = stoi(n);
+            if (jobs<=0) {
+                jobs = max(1u, thread::hardware_concurrency());
+            }
+        } else if (arg=="-file-cache") {
+            string n = args.isEnd()?"":args.nextArg();
+            if (!is_number(n) || n.find('.')!=string::npos) {
+                cerr<<"Error: -file-cache expects a size in MB\n\n";
+                print_help_message(1);
+            }
+            DocumentCache::instance().setLimit(stoull(n)<<20);
+        } else if (arg=="-sort-memory") {
+            string n = args.isEnd()?"":args.nextArg();
+            if (!is_number(n) || n.find('.')!=string::npos) {
+                cerr<<"Error: -sort-memory expects a size in MB\n\n";
+                print_help_message(1);
+            }
+            sort_memory = stoull(n)<<20;
+        } else if (arg=="-pipeline") {
+            string n = args.isEnd()?"":args.nextArg();
+            if (!is_number(n) || n.find('.')!=string::npos) {
+                cerr<<"Error: -pipeline expects the number of threads\n\n";
+                print_help_message(1);
+            }
+            pipeline_threads = stoi(n);
+            if (pipeline_threads<=0) {
+                pipeline_threads = max(1u, thread::hardware_concurrency()/2);
+            }
         } else if (arg=="-h") {
             print_help_message(0);
         } else {
@@ -157,6 +905,18 @@ int main(int argc, char* argv[])
             print_help_message(1);
         }
     }
+    if (input_opts.csv && !input_opts.stream_path.empty()) {
+        cerr<<"Error: with -csv, the only path for -stream is . (each row is processed separately).\n\n";
+        print_help_message(1);
+    }
+    if (pipeline_threads>0 && (input_opts.csv || input_opts.stream || jobs>1)) {
+        cerr<<"Error: -pipeline cannot be combined with -csv, -stream or -j.\n\n";
+        print_help_message(1);
+    }
+    if (per_doc_opt && jobs>1) {
+        cerr<<"Error: -per-doc cannot be combined with -j.\n\n";
+        print_help_message(1);
+    }
     if (query_file.empty()==query_txt.empty()) {
         cerr<<"Error: must specify either -f or -c (but not both).\n\n";
         print_help_message(1);
@@ -189,43 +949,71 @@ int main(int argc, char* argv[])
 
     try {
         TemplateQueryP t = JSONToTQ(json_query);
-        TQDataP tq = t->makeData();
-        TQContext ctx;
-        ctx.opt_show_null = show_nulls_opt;
+        t->collectFields(input_opts.used_fields, true);
         bool use_stdin = args.isEnd();
-        while (!args.isEnd() || use_stdin) {
-            string fname = args.isEnd()?"":args.nextArg();
-            if (recursive_opt && !use_stdin) {
+        vector<string> files;
+        while (!args.isEnd()) {
+            string fname = args.nextArg();
+            if (recursive_opt) {
                 for (const auto& dirEntry : recursive_directory_iterator(fname)) {
-                    if (csv_opt) {
-                        process_csv_file(tq, ctx, dirEntry.path(), delim, csv_headers_opt, false);
-                    } else {
-                        process_json_file(tq, ctx, dirEntry.path(), false);
-                    }
+                    files.push_back(dirEntry.path());
                 }
             } else {
-                if (csv_opt) {
-                    process_csv_file(tq, ctx, fname, delim, csv_headers_opt, use_stdin);
-                } else {
-                    process_json_file(tq, ctx, fname, use_stdin);
-                }
+                files.push_back(fname);
             }
+        }
 
-            use_stdin = false;
-//
+        // The result is written to stdout while it is traversed, instead of building it as a JSON value
+        // and then as a string.
+        char write_buffer[65536];
+        FileWriteStream os(stdout, write_buffer, sizeof(write_buffer));
+        TQDataP tq;
+        // Contexts of all threads. They are kept until the end, since the data trees refer to their allocators.
+        vector<shared_ptr<TQContext> > contexts;
+        jobs = min<size_t>(jobs, files.size());
+        if (jobs>1 && assigns_variables(json_query)) {
+            cerr<<"Warning: the query uses #assign, which depends on the order of the input, so -j is ignored.\n";
+            jobs = 1;
+        }
+        if (jobs>1) {
+            tq = process_files_parallel(t, contexts, files, jobs, input_opts, show_nulls_opt, sort_memory);
+        } else {
+            if (per_doc_opt) {
+                tq = make_shared<PerDocData>(t.get(), os);
+            } else {
+                tq = t->makeData();
+            }
+            contexts.push_back(make_shared<TQContext>());
+            contexts.back()->opt_show_null = show_nulls_opt;
+            contexts.back()->opt_sort_memory = sort_memory;
+            if (use_stdin) {
+                process_file(tq, *contexts.back(), {}, input_opts, true);
+            }
+            if (pipeline_threads>0) {
+                process_json_files_pipelined(tq, *contexts.back(), files, input_opts.used_fields, pipeline_threads);
+            } else {
+                for (const string& f: files) {
+                    process_file(tq, *contexts.back(), f, input_opts, false);
+                }
+            }
         }
+        TQContext& ctx = *contexts[0];
         ctx.in_get_JSON = true;
-        JSONValue value = tq->getJSON(ctx);
+        if (per_doc_opt) {
+            // Already written
+        } else if (compact_opt) {
+            write_result<Writer<FileWriteStream> >(tq, ctx, os);
+        } else {
+            write_result<PrettyWriter<FileWriteStream> >(tq, ctx, os);
+        }
         ctx.in_get_JSON = false;
-        (JSONValue&)(*ctx.doc) = value;
-
-        StringBuffer sb;
-        PrettyWriter<StringBuffer> writer(sb);
-        ctx.doc->Accept(writer);    // Accept() traverses the DOM and generates Handler events.
-        cout<<sb.GetString();
+        os.Flush();
     } catch (ParsingError& e) {
         cerr<<e.message()<<endl;
         exit(1);
+    } catch (QueryError& e) {
+        cerr<<e.message()<<endl;
+        exit(1);
     }
 
     return 0;
@@ -249,7 +249,7 @@ bool isNumOrNumeral(const string& s)
 }
 
 
-bool is_number(const string& s)
+bool is_number(string_view s)
 {
     int point = 0;
     bool digits = false;
@@ -584,13 +584,13 @@ time_t stringToTime(const std::string& s, const std::string& f)
 
 string timeToString(time_t t, const std::string& f)
 {
-    struct tm * dt;
+    struct tm dt;
     char buffer [100];
-    dt = gmtime(&t);
+    gmtime_r(&t, &dt);
     if (!f.empty()) {
-        strftime(buffer, sizeof(buffer), f.c_str(), dt);
+        strftime(buffer, sizeof(buffer), f.c_str(), &dt);
     } else {
-        strftime(buffer, sizeof(buffer), "%m/%d/%Y %T", dt);
+        strftime(buffer, sizeof(buffer), "%m/%d/%Y %T", &dt);
     }
     return buffer;
 }